@@ -188,10 +188,16 @@ int main(int argc, char* argv[]) {
 	}
 
 	int transform_precision = 2;
+	int vox_max_models = 0;
+	int merge_shape_volume = 0;
 	bool disable_convert = false;
 	bool save_as_legacy = false;
 	bool remove_snow = false;
+	bool keep_shape_extents = false;
+	bool keep_disconnected_shapes = false;
 	bool no_voxbox = false;
+	bool incremental_vox = false;
+	bool use_prefabs = false;
 	bool use_tdcz = false;
 	int game_version = 0;
 
@@ -347,9 +353,13 @@ int main(int argc, char* argv[]) {
 			ImGui::SameLine();
 			ImGui::BeginGroup();
 			ImGui::Checkbox("Remove snow", &remove_snow);
+			ImGui::Checkbox("Keep empty space around shapes", &keep_shape_extents);
+			ImGui::Checkbox("Do not split disconnected shapes", &keep_disconnected_shapes);
 			ImGui::Checkbox("Legacy format", &save_as_legacy);
 			ImGui::Checkbox("Do not use voxboxes", &no_voxbox);
 			ImGui::Checkbox("Compress .vox files (very slow)", &use_tdcz);
+			ImGui::Checkbox("Only update changed .vox files", &incremental_vox);
+			ImGui::Checkbox("Save repeated objects as prefabs", &use_prefabs);
 			ImGui::EndGroup();
 			ImGui::SameLine();
 			ImGui::BeginGroup();
@@ -357,6 +367,10 @@ int main(int argc, char* argv[]) {
 			ImGui::TextUnformatted("Decimal digits");
 			ImGui::PushItemWidth(150 * scale);
 			ImGui::SliderInt("##precision", &transform_precision, 0, 10);
+			ImGui::TextUnformatted("Models per .vox (0 = all)");
+			ImGui::SliderInt("##voxmodels", &vox_max_models, 0, 1000);
+			ImGui::TextUnformatted("Merge static shapes (voxels)");
+			ImGui::SliderInt("##mergevolume", &merge_shape_volume, 0, 65536);
 			ImGui::EndGroup();
 			ImGui::Dummy(ImVec2(0, 5 * scale));
 
@@ -426,9 +440,15 @@ int main(int argc, char* argv[]) {
 
 				params->use_voxbox = !no_voxbox;
 				params->remove_snow = remove_snow;
+				params->keep_shape_extents = keep_shape_extents;
+				params->keep_disconnected_shapes = keep_disconnected_shapes;
 				params->compress_vox = use_tdcz;
 				params->legacy_format = save_as_legacy;
 				params->transform_precision = transform_precision;
+				params->vox_max_models = vox_max_models;
+				params->merge_shape_volume = merge_shape_volume;
+				params->incremental_vox = incremental_vox;
+				params->use_prefabs = use_prefabs;
 
 				pthread_create(&parse_thread, nullptr, DecompileMap, params);
 			}
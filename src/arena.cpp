@@ -0,0 +1,56 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+
+Arena::~Arena() {
+	Clear();
+}
+
+void* Arena::Allocate(size_t size, size_t alignment) {
+	size_t padding = (alignment - (uintptr_t)current % alignment) % alignment;
+	if (current == nullptr || padding + size > remaining) {
+		// Big allocations get their own block so the current one is not wasted
+		if (size + alignment > BLOCK_SIZE / 4) {
+			char* block = new char[size + alignment];
+			blocks.push_back(block);
+			padding = (alignment - (uintptr_t)block % alignment) % alignment;
+			return block + padding;
+		}
+		current = new char[BLOCK_SIZE];
+		remaining = BLOCK_SIZE;
+		blocks.push_back(current);
+		padding = (alignment - (uintptr_t)current % alignment) % alignment;
+	}
+	char* ptr = current + padding;
+	current += padding + size;
+	remaining -= padding + size;
+	return ptr;
+}
+
+const char* Arena::CopyString(const char* str, size_t length) {
+	char* copy = static_cast<char*>(Allocate(length + 1, 1));
+	memcpy(copy, str, length);
+	copy[length] = '\0';
+	return copy;
+}
+
+void Arena::Clear() {
+	for (unsigned int i = destructors.size(); i > 0; i--)
+		destructors[i - 1].destroy(destructors[i - 1].object);
+	destructors.clear();
+	for (unsigned int i = 0; i < blocks.size(); i++)
+		delete[] blocks[i];
+	blocks.clear();
+	current = nullptr;
+	remaining = 0;
+}
+
+void Arena::Adopt(Arena& other) {
+	blocks.insert(blocks.end(), other.blocks.begin(), other.blocks.end());
+	other.blocks.clear();
+	destructors.insert(destructors.end(), other.destructors.begin(), other.destructors.end());
+	other.destructors.clear();
+	other.current = nullptr;
+	other.remaining = 0;
+}
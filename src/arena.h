@@ -0,0 +1,51 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Bump allocator for objects that live as long as the arena.
+// Nothing is freed individually. Objects created with New that have a
+// destructor are destroyed together when the arena is cleared, in reverse
+// order of creation.
+class Arena {
+private:
+	struct Destructor {
+		void* object;
+		void (*destroy)(void* object);
+	};
+	static const size_t BLOCK_SIZE = 64 * 1024;
+	vector<char*> blocks;
+	vector<Destructor> destructors;
+	char* current = nullptr;
+	size_t remaining = 0;
+
+	template<typename T>
+	static void Destroy(void* object) {
+		static_cast<T*>(object)->~T();
+	}
+public:
+	Arena() {}
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+	~Arena();
+	void* Allocate(size_t size, size_t alignment = alignof(max_align_t));
+	const char* CopyString(const char* str, size_t length);
+	void Clear();
+	void Adopt(Arena& other); // Takes ownership of the memory of the other arena
+
+	template<typename T, typename... Args>
+	T* New(Args&&... args) {
+		T* object = new (Allocate(sizeof(T), alignof(T))) T(forward<Args>(args)...);
+		if (!is_trivially_destructible<T>::value)
+			destructors.push_back({ object, Destroy<T> });
+		return object;
+	}
+};
+
+#endif
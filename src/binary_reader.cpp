@@ -54,6 +54,33 @@ double FileReader::ReadDouble() {
 	return d;
 }
 
+// Reads the bytes instead of seeking, fseek discards the buffer on some C runtimes
+void FileReader::Skip(long int bytes) {
+	uint8_t scratch[64];
+	while (bytes > 0) {
+		size_t size = bytes < (long int)sizeof(scratch) ? bytes : sizeof(scratch);
+		if (fread(scratch, 1, size, file) != size)
+			return;
+		bytes -= size;
+	}
+}
+
+// Advances past a null terminated string without storing it
+void FileReader::SkipString() {
+	int c;
+	do {
+		c = getc(file);
+	} while (c != '\0' && c != EOF);
+}
+
+long int FileReader::GetPosition() {
+	return ftell(file);
+}
+
+void FileReader::SetPosition(long int position) {
+	fseek(file, position, SEEK_SET);
+}
+
 bool Reader::ReadBool() {
 	uint8_t b = ReadByte();
 	if (b > 1) printf("[WARNING] ReadBool encountered non-bool value: %d\n", b);
@@ -44,6 +44,10 @@ public:
 	uint32_t ReadInt() override;
 	float ReadFloat() override;
 	double ReadDouble() override;
+	void Skip(long int bytes);
+	void SkipString();
+	long int GetPosition();
+	void SetPosition(long int position);
 	~FileReader();
 };
 /*
@@ -24,68 +24,3 @@ const char* LightName[] = {
 	"cone",
 	"area"
 };
-
-static void DeleteEntity(uint8_t type, void* entity) {
-	switch (type) {
-		case Entity::Body:
-			delete static_cast<Body*>(entity);
-			break;
-		case Entity::Shape:
-			delete static_cast<Shape*>(entity);
-			break;
-		case Entity::Light:
-			delete static_cast<Light*>(entity);
-			break;
-		case Entity::Location:
-			delete static_cast<Location*>(entity);
-			break;
-		case Entity::Water:
-			delete static_cast<Water*>(entity);
-			break;
-		case Entity::Joint:
-			delete static_cast<Joint*>(entity);
-			break;
-		case Entity::Vehicle:
-			delete static_cast<Vehicle*>(entity);
-			break;
-		case Entity::Wheel:
-			delete static_cast<Wheel*>(entity);
-			break;
-		case Entity::Screen:
-			delete static_cast<Screen*>(entity);
-			break;
-		case Entity::Trigger:
-			delete static_cast<Trigger*>(entity);
-			break;
-		case Entity::Script:
-			delete static_cast<Script*>(entity);
-			break;
-		case Entity::Animator:
-			delete static_cast<Animator*>(entity);
-			break;
-		case Entity::Rig:
-			delete static_cast<Rig*>(entity);
-			break;
-	}
-}
-
-Entity::~Entity() {
-	for (unsigned int i = 0; i < children.getSize(); i++)
-		delete children[i];
-	DeleteEntity(type, self);
-}
-
-Joint::~Joint() {
-	delete rope;
-}
-
-Script::~Script() {
-	if (has_server) {
-		for (LuaTable::iterator it = server_core.variables->begin(); it != server_core.variables->end(); it++)
-			delete *it;
-		delete server_core.variables;
-	}
-	for (LuaTable::iterator it = client_core.variables->begin(); it != client_core.variables->end(); it++)
-		delete *it;
-	delete client_core.variables;
-}
@@ -14,21 +14,39 @@ template <typename T>
 class Vec {
 private:
 	uint32_t size;
+	uint32_t capacity;
 	T* data;
 public:
+	typedef T* iterator;
+	typedef const T* const_iterator;
+
 	Vec() {
 		size = 0;
+		capacity = 0;
 		data = nullptr;
 	}
+	Vec(const Vec& other) : Vec() {
+		*this = other;
+	}
+	Vec(Vec&& other) {
+		size = other.size;
+		capacity = other.capacity;
+		data = other.data;
+		other.size = 0;
+		other.capacity = 0;
+		other.data = nullptr;
+	}
+	// The buffer is reused if it is big enough, the contents are unspecified after resizing
 	void resize(uint32_t size) {
-		this->size = size;
-		if (size > 0)
+		if (size > capacity) {
+			delete[] data;
 			data = new T[size];
+			capacity = size;
+		}
+		this->size = size;
 	}
 	~Vec() {
-		size = 0;
 		delete[] data;
-		data = nullptr;
 	}
 	uint32_t getSize() const {
 		return size;
@@ -41,16 +59,40 @@ public:
 		}
 		return *this;
 	}
-	T operator[](uint32_t index) const {
-		if (index > size - 1)
+	Vec& operator=(Vec&& other) {
+		if (this != &other) {
+			delete[] data;
+			size = other.size;
+			capacity = other.capacity;
+			data = other.data;
+			other.size = 0;
+			other.capacity = 0;
+			other.data = nullptr;
+		}
+		return *this;
+	}
+	const T& operator[](uint32_t index) const {
+		if (index >= size)
 			throw out_of_range("Index out of range");
 		return data[index];
 	}
 	T& operator[](uint32_t index) {
-		if (index > size - 1)
+		if (index >= size)
 			throw out_of_range("Index out of range");
 		return data[index];
 	}
+	iterator begin() {
+		return data;
+	}
+	iterator end() {
+		return data + size;
+	}
+	const_iterator begin() const {
+		return data;
+	}
+	const_iterator end() const {
+		return data + size;
+	}
 };
 
 template <typename T>
@@ -135,12 +177,11 @@ struct Entity {
 	int handle;
 	SmallVec<Tag> tags;	// tags
 	string desc;		// desc
-	void* self;
+	uint32_t index;		// Position of the object in the pool of its type
 	Vec<Entity*> children;
 	uint32_t beef_beef;
 
 	Entity* parent;		// helper for graph navigation
-	~Entity();
 };
 /*
 enum BodyMode : uint8_t {
@@ -346,7 +387,6 @@ struct Joint {
 	float connection_strength;	// Used for planks 3000.0
 	float disconnect_dist;		// Used for planks 0.8
 	Rope* rope;
-	~Joint();
 };
 
 struct VehicleProperties {
@@ -531,7 +571,9 @@ struct ScriptCore {
 	bool unk1;
 	bool unk2;
 	uint32_t variables_count;
-	LuaTable* variables;
+	long int variables_offset;	// Position of the variables in the file
+	long int variables_size;	// Bytes of the variables in the file
+	LuaTable variables;			// Empty until read with ReadScriptVariables
 	Vec<uint32_t> entities;
 	Vec<ScriptSound> sounds;
 	Vec<ValueTransition> transitions;
@@ -549,7 +591,6 @@ struct Script {
 	bool has_server;
 	ScriptCore server_core;
 	ScriptCore client_core;
-	~Script();
 };
 /*
 struct Bone {
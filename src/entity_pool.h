@@ -0,0 +1,57 @@
+#ifndef ENTITY_POOL_H
+#define ENTITY_POOL_H
+
+#include <new>
+#include <stdint.h>
+#include <vector>
+
+#include "entity.h"
+
+using namespace std;
+
+// Objects of one entity type, in the order they were read. They are stored
+// in blocks so a pass over a single type scans contiguous memory, and they
+// never move, so pointers to them stay valid. Blocks are raw memory, each
+// object is only constructed when it is added.
+template <typename T>
+class EntityPool {
+private:
+	static const uint32_t BLOCK_SIZE = 256;
+	vector<T*> blocks;
+	vector<Entity*> entities; // Entity of each object
+public:
+	EntityPool() {}
+	EntityPool(const EntityPool&) = delete;
+	EntityPool& operator=(const EntityPool&) = delete;
+	~EntityPool() {
+		for (unsigned int i = 0; i < entities.size(); i++)
+			(*this)[i].~T();
+		for (unsigned int i = 0; i < blocks.size(); i++)
+			::operator delete(blocks[i]);
+	}
+
+	// Creates the object of the entity and stores its index in the entity
+	T* Add(Entity* entity) {
+		uint32_t index = entities.size();
+		if (index % BLOCK_SIZE == 0)
+			blocks.push_back(static_cast<T*>(::operator new(BLOCK_SIZE * sizeof(T))));
+		entities.push_back(entity);
+		entity->index = index;
+		return new (&blocks[index / BLOCK_SIZE][index % BLOCK_SIZE]) T();
+	}
+
+	uint32_t getSize() const {
+		return entities.size();
+	}
+	T& operator[](uint32_t index) {
+		return blocks[index / BLOCK_SIZE][index % BLOCK_SIZE];
+	}
+	const T& operator[](uint32_t index) const {
+		return blocks[index / BLOCK_SIZE][index % BLOCK_SIZE];
+	}
+	Entity* GetEntity(uint32_t index) const {
+		return entities[index];
+	}
+};
+
+#endif
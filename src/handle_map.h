@@ -0,0 +1,113 @@
+#ifndef HANDLE_MAP_H
+#define HANDLE_MAP_H
+
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+// Lookup table from entity handles to pointers. Handles are usually small
+// and dense, so they index an array directly. Handles much larger than the
+// number of entries go to an open addressing hash table instead.
+template <typename T>
+class HandleMap {
+private:
+	struct Slot {
+		uint32_t handle;
+		bool used;
+		T* value;
+	};
+	static const uint32_t MIN_DENSE_SIZE = 1024;
+	vector<T*> dense;
+	vector<Slot> sparse; // Size is zero or a power of two, at most half full
+	uint32_t sparse_count = 0;
+	uint32_t count = 0;
+
+	uint32_t Probe(uint32_t handle) const {
+		uint32_t mask = sparse.size() - 1;
+		uint32_t i = (handle * 0x9E3779B1u) & mask;
+		while (sparse[i].used && sparse[i].handle != handle)
+			i = (i + 1) & mask;
+		return i;
+	}
+
+	void SetSparse(uint32_t handle, T* value) {
+		if (2 * (sparse_count + 1) > sparse.size()) {
+			vector<Slot> old_slots;
+			old_slots.swap(sparse);
+			sparse.assign(old_slots.empty() ? 16 : 2 * old_slots.size(), { 0, false, nullptr });
+			for (unsigned int i = 0; i < old_slots.size(); i++)
+				if (old_slots[i].used)
+					sparse[Probe(old_slots[i].handle)] = old_slots[i];
+		}
+		Slot& slot = sparse[Probe(handle)];
+		if (!slot.used) {
+			slot.used = true;
+			slot.handle = handle;
+			sparse_count++;
+		}
+		slot.value = value;
+	}
+
+	// Moves the hashed handles that now fit in the array
+	void GrowDense(uint32_t size) {
+		dense.resize(size, nullptr);
+		if (sparse_count == 0)
+			return;
+		vector<Slot> old_slots;
+		old_slots.swap(sparse);
+		sparse_count = 0;
+		for (unsigned int i = 0; i < old_slots.size(); i++)
+			if (old_slots[i].used) {
+				if (old_slots[i].handle < size)
+					dense[old_slots[i].handle] = old_slots[i].value;
+				else
+					SetSparse(old_slots[i].handle, old_slots[i].value);
+			}
+	}
+public:
+	void Set(uint32_t handle, T* value) {
+		if (handle >= dense.size()) {
+			uint64_t dense_limit = 4 * (uint64_t)(count + 1);
+			if (dense_limit < MIN_DENSE_SIZE)
+				dense_limit = MIN_DENSE_SIZE;
+			if (handle >= dense_limit) {
+				if (Get(handle) == nullptr)
+					count++;
+				SetSparse(handle, value);
+				return;
+			}
+			uint64_t size = 2 * (uint64_t)dense.size();
+			if (size <= handle)
+				size = (uint64_t)handle + 1;
+			if (size > dense_limit)
+				size = dense_limit;
+			GrowDense(size);
+		}
+		if (dense[handle] == nullptr)
+			count++;
+		dense[handle] = value;
+	}
+
+	T* Get(uint32_t handle) const {
+		if (handle < dense.size())
+			return dense[handle];
+		if (sparse_count == 0)
+			return nullptr;
+		const Slot& slot = sparse[Probe(handle)];
+		return slot.used ? slot.value : nullptr;
+	}
+
+	// Calls function(handle, value) for every handle set
+	template <typename F>
+	void ForEach(F function) const {
+		for (unsigned int i = 0; i < dense.size(); i++)
+			if (dense[i] != nullptr)
+				function(i, dense[i]);
+		for (unsigned int i = 0; i < sparse.size(); i++)
+			if (sparse[i].used && sparse[i].value != nullptr)
+				function(sparse[i].handle, sparse[i].value);
+	}
+};
+
+#endif
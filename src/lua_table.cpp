@@ -5,19 +5,36 @@ LuaTableEntry::LuaTableEntry() {
 	value_type = NIL;
 }
 
-LuaTableEntry::~LuaTableEntry() {
-	if (key_type == String)
-		delete[] key.String;
-	else if (key_type == Table) {
-		for (LuaTable::iterator it = key.Table->begin(); it != key.Table->end(); it++)
-			delete *it;
-		delete key.Table;
-	}
-	if (value_type == String)
-		delete[] value.String;
-	else if (value_type == Table) {
-		for (LuaTable::iterator it = value.Table->begin(); it != value.Table->end(); it++)
-			delete *it;
-		delete value.Table;
-	}
+uint32_t LuaTable::AddString(const string& text) {
+	uint32_t offset = strings.size();
+	strings.append(text.c_str(), text.size() + 1);
+	return offset;
+}
+
+// Copies the entries of a table that has been read completely
+uint32_t LuaTable::AddTable(const LuaTableEntry* table_entries, uint32_t count) {
+	Range range = { (uint32_t)entries.size(), count };
+	entries.insert(entries.end(), table_entries, table_entries + count);
+	tables.push_back(range);
+	return tables.size() - 1;
+}
+
+bool LuaTable::IsEmpty() const {
+	return tables.empty();
+}
+
+uint32_t LuaTable::GetRoot() const {
+	return tables.size() - 1;
+}
+
+uint32_t LuaTable::GetSize(uint32_t table) const {
+	return tables[table].count;
+}
+
+const LuaTableEntry& LuaTable::GetEntry(uint32_t table, uint32_t index) const {
+	return entries[tables[table].first + index];
+}
+
+const char* LuaTable::GetString(uint32_t offset) const {
+	return strings.c_str() + offset;
 }
@@ -2,6 +2,7 @@
 #define LUATABLE_H
 
 #include <stdint.h>
+#include <string>
 #include <vector>
 
 using namespace std;
@@ -20,14 +21,11 @@ enum LuaType : uint32_t {
 	Reference = 0xFFFFFFFB // -5
 };
 
-struct LuaTableEntry;
-typedef vector<LuaTableEntry*> LuaTable;
-
 union LuaValue {
 	bool Boolean;
 	double Number;
-	char* String;
-	LuaTable* Table;
+	uint32_t String;	// Offset in the strings of the LuaTable
+	uint32_t Table;		// Index of a nested table of the LuaTable
 	uint32_t Reference;
 };
 
@@ -40,7 +38,29 @@ struct LuaTableEntry {
 	LuaValue value;
 
 	LuaTableEntry();
-	~LuaTableEntry();
+};
+
+// Tree of Lua tables stored in a few flat arrays. The entries of each table
+// are consecutive. Nested tables are stored before the table containing them,
+// so the root table is the last one. Strings are kept in a single buffer.
+class LuaTable {
+private:
+	struct Range {
+		uint32_t first;
+		uint32_t count;
+	};
+	vector<LuaTableEntry> entries;
+	vector<Range> tables;
+	string strings; // Separated by '\0'
+public:
+	uint32_t AddString(const string& text);
+	uint32_t AddTable(const LuaTableEntry* table_entries, uint32_t count);
+
+	bool IsEmpty() const;
+	uint32_t GetRoot() const;
+	uint32_t GetSize(uint32_t table) const;
+	const LuaTableEntry& GetEntry(uint32_t table, uint32_t index) const;
+	const char* GetString(uint32_t offset) const;
 };
 
 #endif
@@ -1,5 +1,9 @@
+#include <algorithm>
+#include <charconv>
 #include <math.h>
 #include <stdexcept>
+#include <string.h>
+#include <string>
 
 #include "math_utils.h"
 
@@ -15,6 +19,24 @@ bool FloatEquals(float a, float b) {
 	return fabs(a - b) < 0.0001;
 }
 
+// Fixed notation without trailing zeros, values close to zero are written as 0
+string FloatToString(float value, int precision) {
+	if (fabs(value) < 0.0005)
+		value = 0;
+	char buffer[64];
+	to_chars_result result = to_chars(buffer, buffer + sizeof(buffer), (double)value, chars_format::fixed, precision);
+	if (result.ec != errc())
+		return to_string(value);
+	char* end = result.ptr;
+	if (memchr(buffer, '.', end - buffer) != nullptr) {
+		while (end[-1] == '0')
+			end--;
+		if (end[-1] == '.')
+			end--;
+	}
+	return string(buffer, end);
+}
+
 float Vec3::length() const {
 	return sqrt(x * x + y * y + z * z);
 }
@@ -131,6 +153,13 @@ Transform TransformToLocalTransform(const Transform& parent, const Transform& ch
 	return local_tr;
 }
 
+Transform TransformToWorldTransform(const Transform& parent, const Transform& child) {
+	Transform world_tr;
+	world_tr.pos = parent.pos + parent.rot * child.pos;
+	world_tr.rot = parent.rot * child.rot;
+	return world_tr;
+}
+
 bool Transform::isDefault() {
 	return pos.isZero() && FloatEquals(rot.x, 0) && FloatEquals(rot.y, 0) && FloatEquals(rot.z, 0) && FloatEquals(rot.w, 1);
 }
@@ -183,6 +212,62 @@ int Tensor3D::GetNonZeroCount() const {
 	return count;
 }
 
+// Smallest box with all the non-zero values, max is exclusive. False if there are none.
+bool Tensor3D::GetBounds(int min[3], int max[3]) const {
+	const int region_min[3] = { 0, 0, 0 };
+	const int region_max[3] = { sizex, sizey, sizez };
+	return GetBounds(region_min, region_max, min, max);
+}
+
+// Same, only looking inside a region of the tensor
+bool Tensor3D::GetBounds(const int region_min[3], const int region_max[3], int min[3], int max[3]) const {
+	for (int i = 0; i < 3; i++) {
+		min[i] = region_max[i];
+		max[i] = region_min[i];
+	}
+	for (int z = region_min[2]; z < region_max[2]; z++)
+		for (int y = region_min[1]; y < region_max[1]; y++) {
+			const uint8_t* row = &data[sizex * (y + sizey * z)];
+			for (int x = region_min[0]; x < region_max[0]; x++)
+				if (row[x] != 0) {
+					if (x < min[0]) min[0] = x;
+					if (y < min[1]) min[1] = y;
+					if (z < min[2]) min[2] = z;
+					if (x >= max[0]) max[0] = x + 1;
+					if (y >= max[1]) max[1] = y + 1;
+					if (z >= max[2]) max[2] = z + 1;
+				}
+		}
+	return max[0] > min[0];
+}
+
+Tensor3D Tensor3D::Crop(int x, int y, int z, int sizex, int sizey, int sizez) const {
+	if (x < 0 || y < 0 || z < 0 || x + sizex > this->sizex || y + sizey > this->sizey || z + sizez > this->sizez)
+		throw out_of_range("Crop out of range");
+	Tensor3D result(sizex, sizey, sizez);
+	for (int k = 0; k < sizez; k++)
+		for (int j = 0; j < sizey; j++) {
+			const uint8_t* row = &data[x + this->sizex * (y + j + this->sizey * (z + k))];
+			copy(row, row + sizex, &result.data[sizex * (j + sizey * k)]);
+		}
+	return result;
+}
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed) {
+	uint64_t hash = seed;
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 0x100000001B3;
+	return hash;
+}
+
+// Hash of the size and content of the tensor
+uint64_t Tensor3D::GetHash() const {
+	const int dims[3] = { sizex, sizey, sizez };
+	uint64_t hash = HashBytes(dims, sizeof(dims));
+	return HashBytes(data.data(), data.size(), hash);
+}
+
 const uint8_t* Tensor3D::ToArray() const {
 	return data.data();
 }
@@ -2,6 +2,7 @@
 #define MATH_UTILS_H
 
 #include <stdint.h>
+#include <string>
 #include <vector>
 
 using namespace std;
@@ -52,17 +53,26 @@ public:
 	bool IsFilledSingleColor() const;
 	int GetVolume() const;
 	int GetNonZeroCount() const;
+	bool GetBounds(int min[3], int max[3]) const;
+	bool GetBounds(const int region_min[3], const int region_max[3], int min[3], int max[3]) const;
+	Tensor3D Crop(int x, int y, int z, int sizex, int sizey, int sizez) const;
+	uint64_t GetHash() const;
 	const uint8_t* ToArray() const;
 };
 
 double deg(double rad);
 double rad(double deg);
 bool FloatEquals(float a, float b);
+string FloatToString(float value, int precision);
+// FNV-1a hash of the bytes, the seed continues a previous hash
+static const uint64_t HASH_SEED = 0xCBF29CE484222325;
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed = HASH_SEED);
 Quat QuatEuler(double roll, double yaw, double pitch);
 Quat QuatEulerRad(double roll, double yaw, double pitch);
 Vec3 QuatToEuler(Quat q);
 Quat FromAxisAngle(Vec3 axis, float angle);
 Transform TransformToLocalTransform(const Transform& parent, const Transform& child);
+Transform TransformToWorldTransform(const Transform& parent, const Transform& child);
 
 Quat operator*(const Quat& p, const Quat& q);
 Vec3 operator*(const Quat& q, const Vec3& p1);
@@ -1,7 +1,6 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <string.h>
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -30,11 +29,6 @@ void TDBIN::InitScene(string input) {
 	printf("Parsing file...\n");
 }
 
-TDBIN::~TDBIN() {
-	for (unsigned int i = 0; i < scene.entities.getSize(); i++)
-		delete scene.entities[i];
-}
-
 Fire TDBIN::ReadFire() {
 	Fire fire;
 	fire.shape = ReadInt();
@@ -65,8 +59,51 @@ Palette TDBIN::ReadPalette() {
 	return p;
 }
 
+static uint64_t HashMaterials(const Palette& palette) {
+	uint64_t hash = HASH_SEED;
+	for (int i = 0; i < 256; i++) {
+		const Material& mat = palette.materials[i];
+		hash = HashBytes(&mat.type, sizeof(mat.type), hash);
+		hash = HashBytes(&mat.rgba, sizeof(mat.rgba), hash);
+		hash = HashBytes(&mat.reflectivity, sizeof(mat.reflectivity), hash);
+		hash = HashBytes(&mat.shinyness, sizeof(mat.shinyness), hash);
+		hash = HashBytes(&mat.metalness, sizeof(mat.metalness), hash);
+		hash = HashBytes(&mat.emissive, sizeof(mat.emissive), hash);
+		hash = HashBytes(&mat.is_tint, sizeof(mat.is_tint), hash);
+	}
+	return hash;
+}
+
+static bool SameMaterials(const Palette& a, const Palette& b) {
+	for (int i = 0; i < 256; i++) {
+		const Material& mat_a = a.materials[i];
+		const Material& mat_b = b.materials[i];
+		if (mat_a.type != mat_b.type || mat_a.rgba.r != mat_b.rgba.r || mat_a.rgba.g != mat_b.rgba.g ||
+			mat_a.rgba.b != mat_b.rgba.b || mat_a.rgba.a != mat_b.rgba.a || mat_a.reflectivity != mat_b.reflectivity ||
+			mat_a.shinyness != mat_b.shinyness || mat_a.metalness != mat_b.metalness ||
+			mat_a.emissive != mat_b.emissive || mat_a.is_tint != mat_b.is_tint)
+			return false;
+	}
+	return true;
+}
+
+// Shapes using palettes with identical materials can share the same vox file
+void TDBIN::MapPalettes() {
+	map<uint64_t, uint32_t> first_palette;
+	palette_mapping.resize(scene.palettes.getSize());
+	for (unsigned int i = 0; i < scene.palettes.getSize(); i++) {
+		palette_mapping[i] = i;
+		uint64_t hash = HashMaterials(scene.palettes[i]);
+		map<uint64_t, uint32_t>::iterator it = first_palette.find(hash);
+		if (it == first_palette.end())
+			first_palette[hash] = i;
+		else if (SameMaterials(scene.palettes[it->second], scene.palettes[i]))
+			palette_mapping[i] = it->second;
+	}
+}
+
 Rope* TDBIN::ReadRope() {
-	Rope* rope = new Rope();
+	Rope* rope = scene.arena.New<Rope>();
 	rope->color = ReadColor();
 	rope->zero = ReadFloat();
 	rope->strength = ReadFloat();
@@ -77,9 +114,9 @@ Rope* TDBIN::ReadRope() {
 
 	int segments = ReadInt();
 	rope->segments.resize(segments);
-	for (int i = 0; i < segments; i++) {
-		rope->segments[i].from = ReadVec3();
-		rope->segments[i].to = ReadVec3();
+	for (Vec<Segment>::iterator it = rope->segments.begin(); it != rope->segments.end(); it++) {
+		it->from = ReadVec3();
+		it->to = ReadVec3();
 	}
 	return rope;
 }
@@ -129,7 +166,7 @@ Voxels TDBIN::ReadVoxels() {
 	return voxels;
 }
 
-LuaValue TDBIN::ReadLuaValue(LuaType key_type) {
+LuaValue TDBIN::ReadLuaValue(LuaType key_type, LuaTable& table) {
 	LuaValue value;
 	switch (key_type) {
 	case Boolean:
@@ -138,13 +175,11 @@ LuaValue TDBIN::ReadLuaValue(LuaType key_type) {
 	case Number:
 		value.Number = ReadDouble();
 		break;
-	case String: {
-		string text = ReadString();
-		value.String = new char[text.length() + 1];
-		strcpy(value.String, text.c_str());
-	} break;
+	case String:
+		value.String = table.AddString(ReadString());
+		break;
 	case Table:
-		value.Table = ReadLuaTable();
+		value.Table = ReadLuaTable(table);
 		break;
 	case Reference:
 		value.Reference = ReadInt();
@@ -157,29 +192,81 @@ LuaValue TDBIN::ReadLuaValue(LuaType key_type) {
 	return value;
 }
 
-LuaTable* TDBIN::ReadLuaTable() {
-	LuaTable* table = new LuaTable();
+// Entries of nested tables are read on top of the entries of their parent,
+// each table is moved to the flat table once all its entries are read
+uint32_t TDBIN::ReadLuaTable(LuaTable& table) {
+	unsigned int start = lua_entries.size();
 	do {
 		LuaType key_type = (LuaType)ReadInt();
 		if (key_type == NIL)
 			break;
 
-		LuaTableEntry* table_entry = new LuaTableEntry();
-		table_entry->key_type = key_type;
-		table_entry->key = ReadLuaValue(table_entry->key_type);
-		table_entry->value_type = (LuaType)ReadInt();
-		table_entry->value = ReadLuaValue(table_entry->value_type);
-		table->push_back(table_entry);
+		LuaTableEntry table_entry;
+		table_entry.key_type = key_type;
+		table_entry.key = ReadLuaValue(table_entry.key_type, table);
+		table_entry.value_type = (LuaType)ReadInt();
+		table_entry.value = ReadLuaValue(table_entry.value_type, table);
+		lua_entries.push_back(table_entry);
+	} while (true);
+	uint32_t index = table.AddTable(lua_entries.data() + start, lua_entries.size() - start);
+	lua_entries.resize(start);
+	return index;
+}
+
+void TDBIN::SkipLuaValue(LuaType key_type) {
+	switch (key_type) {
+	case Boolean:
+		Skip(1);
+		break;
+	case Number:
+		Skip(8);
+		break;
+	case String:
+		SkipString();
+		break;
+	case Table:
+		SkipLuaTable();
+		break;
+	case Reference:
+		Skip(4);
+		break;
+	case NIL:
+		break;
+	default:
+		break;
+	}
+}
+
+// Advances past a Lua table without storing anything
+void TDBIN::SkipLuaTable() {
+	do {
+		LuaType key_type = (LuaType)ReadInt();
+		if (key_type == NIL)
+			break;
+		SkipLuaValue(key_type);
+		SkipLuaValue((LuaType)ReadInt());
 	} while (true);
-	return table;
+}
+
+// Reads the variables of a script core skipped while parsing the file.
+// Moves the position of the file, do not call it from several threads.
+void TDBIN::ReadScriptVariables(ScriptCore& core) {
+	if (!core.variables.IsEmpty())
+		return;
+	long int position = GetPosition();
+	SetPosition(core.variables_offset);
+	ReadLuaTable(core.variables);
+	if (GetPosition() != core.variables_offset + core.variables_size)
+		printf("[WARNING] Script variables do not end where they did when parsing.\n");
+	SetPosition(position);
 }
 
 Entity* TDBIN::ReadEntity() {
-	Entity* entity = new Entity();
+	Entity* entity = scene.arena.New<Entity>();
 	entity->type = ReadByte();
 
 	entity->handle = ReadInt();
-	entity_mapping[entity->handle] = entity;
+	entity_mapping.Set(entity->handle, entity);
 	//printf("Reading %s with handle %d\n", EntityName[entity->type], entity->handle);
 
 	uint8_t tag_count = ReadByte();
@@ -188,7 +275,7 @@ Entity* TDBIN::ReadEntity() {
 		entity->tags[i] = ReadTag();
 
 	entity->desc = ReadString();
-	entity->self = ReadEntityType(entity->type);
+	ReadEntityType(entity);
 
 	int childrens = ReadInt();
 	entity->children.resize(childrens);
@@ -205,8 +292,8 @@ Entity* TDBIN::ReadEntity() {
 	return entity;
 }
 
-Body* TDBIN::ReadBody() {
-	Body* body = new Body();
+Body* TDBIN::ReadBody(Entity* entity) {
+	Body* body = scene.bodies.Add(entity);
 	body->flags = ReadWord();
 	body->transform = ReadTransform();
 	body->velocity = ReadVec3();
@@ -220,8 +307,8 @@ Body* TDBIN::ReadBody() {
 	return body;
 }
 
-Shape* TDBIN::ReadShape() {
-	Shape* shape = new Shape();
+Shape* TDBIN::ReadShape(Entity* entity) {
+	Shape* shape = scene.shapes.Add(entity);
 	shape->flags = ReadWord();
 	shape->transform = ReadTransform();
 	shape->shape_flags = ReadWord();
@@ -249,8 +336,8 @@ Shape* TDBIN::ReadShape() {
 	return shape;
 }
 
-Light* TDBIN::ReadLight() {
-	Light* light = new Light();
+Light* TDBIN::ReadLight(Entity* entity) {
+	Light* light = scene.lights.Add(entity);
 	light->is_on = ReadBool();
 	light->type = ReadByte();
 
@@ -277,15 +364,15 @@ Light* TDBIN::ReadLight() {
 	return light;
 }
 
-Location* TDBIN::ReadLocation() {
-	Location* location = new Location();
+Location* TDBIN::ReadLocation(Entity* entity) {
+	Location* location = scene.locations.Add(entity);
 	location->flags = ReadWord();
 	location->transform = ReadTransform();
 	return location;
 }
 
-Water* TDBIN::ReadWater() {
-	Water* water = new Water();
+Water* TDBIN::ReadWater(Entity* entity) {
+	Water* water = scene.waters.Add(entity);
 	water->flags = ReadWord();
 	water->transform = ReadTransform();
 	water->depth = ReadFloat();
@@ -334,8 +421,8 @@ Water* TDBIN::ReadWater() {
 	return water;
 }
 
-Joint* TDBIN::ReadJoint() {
-	Joint* joint = new Joint();
+Joint* TDBIN::ReadJoint(Entity* entity) {
+	Joint* joint = scene.joints.Add(entity);
 	joint->type = ReadInt();
 	for (int i = 0; i < 2; i++)
 		joint->shapes[i] = ReadInt();
@@ -363,8 +450,8 @@ Joint* TDBIN::ReadJoint() {
 	return joint;
 }
 
-Vehicle* TDBIN::ReadVehicle() {
-	Vehicle* vehicle = new Vehicle();
+Vehicle* TDBIN::ReadVehicle(Entity* entity) {
+	Vehicle* vehicle = scene.vehicles.Add(entity);
 	vehicle->flags = ReadWord();
 	vehicle->body = ReadInt();
 	vehicle->transform = ReadTransform();
@@ -395,35 +482,35 @@ Vehicle* TDBIN::ReadVehicle() {
 
 	int exhaust_count = ReadInt();
 	vehicle->exhausts.resize(exhaust_count);
-	for (int i = 0; i < exhaust_count; i++) {
-		vehicle->exhausts[i].transform = ReadTransform();
-		vehicle->exhausts[i].strength = ReadFloat();
+	for (Vec<Exhaust>::iterator it = vehicle->exhausts.begin(); it != vehicle->exhausts.end(); it++) {
+		it->transform = ReadTransform();
+		it->strength = ReadFloat();
 	}
 
 	int vital_count = ReadInt();
 	vehicle->vitals.resize(vital_count);
-	for (int i = 0; i < vital_count; i++) {
-		vehicle->vitals[i].body = ReadInt();
-		vehicle->vitals[i].position = ReadVec3();
-		vehicle->vitals[i].radius = ReadFloat();
-		vehicle->vitals[i].nearby_voxels = ReadInt();
+	for (Vec<Vital>::iterator it = vehicle->vitals.begin(); it != vehicle->vitals.end(); it++) {
+		it->body = ReadInt();
+		it->position = ReadVec3();
+		it->radius = ReadFloat();
+		it->nearby_voxels = ReadInt();
 	}
 
 	int loc_count = ReadInt();
 	vehicle->locations.resize(loc_count);
-	for (int i = 0; i < loc_count; i++) {
-		vehicle->locations[i].name = ReadString();
-		vehicle->locations[i].transform = ReadTransform();
-		vehicle->locations[i].handle = ReadInt();
+	for (Vec<VehicleLocation>::iterator it = vehicle->locations.begin(); it != vehicle->locations.end(); it++) {
+		it->name = ReadString();
+		it->transform = ReadTransform();
+		it->handle = ReadInt();
 	}
 
 	int passenger_count = ReadInt();
 	vehicle->passengers.resize(passenger_count);
-	for (int i = 0; i < passenger_count; i++) {
-		vehicle->passengers[i].unk1[0] = ReadInt();
-		vehicle->passengers[i].unk1[1] = ReadInt();
-		vehicle->passengers[i].unk1[2] = ReadInt();
-		vehicle->passengers[i].unk2 = ReadBool();
+	for (Vec<VehiclePassenger>::iterator it = vehicle->passengers.begin(); it != vehicle->passengers.end(); it++) {
+		it->unk1[0] = ReadInt();
+		it->unk1[1] = ReadInt();
+		it->unk1[2] = ReadInt();
+		it->unk2 = ReadBool();
 	}
 
 	vehicle->bounds_dist = ReadFloat();
@@ -433,8 +520,8 @@ Vehicle* TDBIN::ReadVehicle() {
 	return vehicle;
 }
 
-Wheel* TDBIN::ReadWheel() {
-	Wheel* wheel = new Wheel();
+Wheel* TDBIN::ReadWheel(Entity* entity) {
+	Wheel* wheel = scene.wheels.Add(entity);
 	wheel->flags = ReadWord();
 	wheel->vehicle = ReadInt();
 	wheel->vehicle_body = ReadInt();
@@ -457,8 +544,8 @@ Wheel* TDBIN::ReadWheel() {
 	return wheel;
 }
 
-Screen* TDBIN::ReadScreen() {
-	Screen* screen = new Screen();
+Screen* TDBIN::ReadScreen(Entity* entity) {
+	Screen* screen = scene.screens.Add(entity);
 	screen->flags = ReadWord();
 	screen->transform = ReadTransform();
 	screen->size = ReadVec2();
@@ -476,8 +563,8 @@ Screen* TDBIN::ReadScreen() {
 	return screen;
 }
 
-Trigger* TDBIN::ReadTrigger() {
-	Trigger* trigger = new Trigger();
+Trigger* TDBIN::ReadTrigger(Entity* entity) {
+	Trigger* trigger = scene.triggers.Add(entity);
 	trigger->flags = ReadWord();
 	trigger->transform = ReadTransform();
 	trigger->type = ReadInt();
@@ -495,8 +582,8 @@ Trigger* TDBIN::ReadTrigger() {
 	return trigger;
 };
 
-ScriptCore TDBIN::ReadScriptCore() {
-	ScriptCore core;
+// Read in place, copying the core would copy its Lua table
+void TDBIN::ReadScriptCore(ScriptCore& core) {
 	int param_count = ReadInt();
 	core.params.resize(param_count);
 	for (int i = 0; i < param_count; i++)
@@ -507,7 +594,10 @@ ScriptCore TDBIN::ReadScriptCore() {
 	core.unk1 = ReadBool();
 	core.unk2 = ReadBool();
 	core.variables_count = ReadInt();
-	core.variables = ReadLuaTable();
+	// The converter does not use the variables, they are only read on demand
+	core.variables_offset = GetPosition();
+	SkipLuaTable();
+	core.variables_size = GetPosition() - core.variables_offset;
 
 	int entity_count = ReadInt();
 	core.entities.resize(entity_count);
@@ -516,42 +606,41 @@ ScriptCore TDBIN::ReadScriptCore() {
 
 	int sound_count = ReadInt();
 	core.sounds.resize(sound_count);
-	for (int i = 0; i < sound_count; i++) {
-		core.sounds[i].type = ReadInt();
-		core.sounds[i].path = ReadString();
-		core.sounds[i].name = ReadString();
+	for (Vec<ScriptSound>::iterator it = core.sounds.begin(); it != core.sounds.end(); it++) {
+		it->type = ReadInt();
+		it->path = ReadString();
+		it->name = ReadString();
 	}
 
 	int transition_count = ReadInt();
 	core.transitions.resize(transition_count);
-	for (int i = 0; i < transition_count; i++) {
-		core.transitions[i].variable = ReadString();
-		core.transitions[i].transition = ReadByte();
-		core.transitions[i].target_time = ReadFloat();
-		core.transitions[i].current_time = ReadFloat();
-		core.transitions[i].current_value = ReadFloat();
-		core.transitions[i].target_value = ReadFloat();
+	for (Vec<ValueTransition>::iterator it = core.transitions.begin(); it != core.transitions.end(); it++) {
+		it->variable = ReadString();
+		it->transition = ReadByte();
+		it->target_time = ReadFloat();
+		it->current_time = ReadFloat();
+		it->current_value = ReadFloat();
+		it->target_value = ReadFloat();
 	}
 
 	int unk3_count = ReadInt();
 	core.unk3.resize(unk3_count);
-	for (int i = 0; i < unk3_count; i++) {
-		core.unk3[i].handle = ReadInt();
-		core.unk3[i].path = ReadString();
+	for (Vec<ScriptSprite>::iterator it = core.unk3.begin(); it != core.unk3.end(); it++) {
+		it->handle = ReadInt();
+		it->path = ReadString();
 	}
 
 	// Note: vector size type is uint16_t
 	int unk4_count = ReadWord();
 	core.unk4.resize(unk4_count);
-	for (int i = 0; i < unk4_count; i++) {
-		core.unk4[i].first = ReadInt();
-		core.unk4[i].second = ReadInt();
+	for (MediumVec<IntPair>::iterator it = core.unk4.begin(); it != core.unk4.end(); it++) {
+		it->first = ReadInt();
+		it->second = ReadInt();
 	}
-	return core;
 }
 
-Script* TDBIN::ReadScript() {
-	Script* script = new Script();
+Script* TDBIN::ReadScript(Entity* entity) {
+	Script* script = scene.scripts.Add(entity);
 	script->flags = ReadWord();
 	script->unk1 = ReadInt();
 	script->file = ReadString();
@@ -560,15 +649,15 @@ Script* TDBIN::ReadScript() {
 	script->unk4 = ReadBool();
 	script->has_server = ReadBool();
 	if (script->has_server)
-		script->server_core = ReadScriptCore();
-	script->client_core = ReadScriptCore();
+		ReadScriptCore(script->server_core);
+	ReadScriptCore(script->client_core);
 	return script;
 }
 
-Animator* TDBIN::ReadAnimator() {
+Animator* TDBIN::ReadAnimator(Entity* entity) {
 	int entries = 0;
 	uint8_t* buffer = nullptr;
-	Animator* animator = new Animator();
+	Animator* animator = scene.animators.Add(entity);
 	animator->flags = ReadWord();
 	animator->transform = ReadTransform();
 	animator->path = ReadString();
@@ -678,15 +767,15 @@ Animator* TDBIN::ReadAnimator() {
 	return animator;
 }
 
-Rig* TDBIN::ReadRig() {
-	Rig* rig = new Rig();
+Rig* TDBIN::ReadRig(Entity* entity) {
+	Rig* rig = scene.rigs.Add(entity);
 	rig->flags = ReadWord();
 	int loc_count = ReadInt();
 	rig->locations.resize(loc_count);
-	for (int i = 0; i < loc_count; i++) {
-		rig->locations[i].tags = ReadString();
-		rig->locations[i].transform = ReadTransform();
-		rig->locations[i].unk1 = ReadBool();
+	for (Vec<RigLocation>::iterator it = rig->locations.begin(); it != rig->locations.end(); it++) {
+		it->tags = ReadString();
+		it->transform = ReadTransform();
+		it->unk1 = ReadBool();
 	}
 	rig->transform = ReadTransform();
 	rig->unk1 = ReadBool();
@@ -695,38 +784,50 @@ Rig* TDBIN::ReadRig() {
 	return rig;
 }
 
-void* TDBIN::ReadEntityType(uint8_t type) {
-	switch (type) {
+void TDBIN::ReadEntityType(Entity* entity) {
+	switch (entity->type) {
 	case Entity::Body:
-		return ReadBody();
+		ReadBody(entity);
+		break;
 	case Entity::Shape:
-		return ReadShape();
+		ReadShape(entity);
+		break;
 	case Entity::Light:
-		return ReadLight();
+		ReadLight(entity);
+		break;
 	case Entity::Location:
-		return ReadLocation();
+		ReadLocation(entity);
+		break;
 	case Entity::Water:
-		return ReadWater();
+		ReadWater(entity);
+		break;
 	case Entity::Joint:
-		return ReadJoint();
+		ReadJoint(entity);
+		break;
 	case Entity::Vehicle:
-		return ReadVehicle();
+		ReadVehicle(entity);
+		break;
 	case Entity::Wheel:
-		return ReadWheel();
+		ReadWheel(entity);
+		break;
 	case Entity::Screen:
-		return ReadScreen();
+		ReadScreen(entity);
+		break;
 	case Entity::Trigger:
-		return ReadTrigger();
+		ReadTrigger(entity);
+		break;
 	case Entity::Script:
-		return ReadScript();
+		ReadScript(entity);
+		break;
 	case Entity::Animator:
-		return ReadAnimator();
+		ReadAnimator(entity);
+		break;
 	case Entity::Rig:
-		return ReadRig();
+		ReadRig(entity);
+		break;
 	default:
-		printf("[ERROR] Invalid entity type: %d\n", (uint8_t)type);
+		printf("[ERROR] Invalid entity type: %d\n", entity->type);
 		exit(EXIT_FAILURE);
-		return nullptr;
 	}
 }
 
@@ -784,11 +885,11 @@ void TDBIN::ReadPlayers() {
 			player->tools_info[j] = ReadToolInfo();
 		int mod_tool_count = ReadInt();
 		player->mod_tools_info.resize(mod_tool_count);
-		for (int j = 0; j < mod_tool_count; j++) {
-			player->mod_tools_info[j].base = ReadToolInfo();
-			player->mod_tools_info[j].path = ReadString();
-			player->mod_tools_info[j].file = ReadString();
-			player->mod_tools_info[j].group = ReadInt();
+		for (Vec<ToolInfoExtended>::iterator it = player->mod_tools_info.begin(); it != player->mod_tools_info.end(); it++) {
+			it->base = ReadToolInfo();
+			it->path = ReadString();
+			it->file = ReadString();
+			it->group = ReadInt();
 		}
 		player->current_tool = ReadString();
 	}
@@ -924,15 +1025,15 @@ void TDBIN::parse() {
 
 	entries = ReadInt();
 	scene.projectiles.resize(entries);
-	for (int i = 0; i < entries; i++) {
-		scene.projectiles[i].origin = ReadVec3();
-		scene.projectiles[i].direction = ReadVec3();
-		scene.projectiles[i].dist = ReadFloat();
-		scene.projectiles[i].max_dist = ReadFloat();
-		scene.projectiles[i].strength = ReadFloat();
-		scene.projectiles[i].type = ReadInt();
-		scene.projectiles[i].player_id = ReadInt();
-		scene.projectiles[i].impact = ReadBool();
+	for (Vec<Projectile>::iterator it = scene.projectiles.begin(); it != scene.projectiles.end(); it++) {
+		it->origin = ReadVec3();
+		it->direction = ReadVec3();
+		it->dist = ReadFloat();
+		it->max_dist = ReadFloat();
+		it->strength = ReadFloat();
+		it->type = ReadInt();
+		it->player_id = ReadInt();
+		it->impact = ReadBool();
 	}
 
 	int fire_count = ReadInt();
@@ -946,6 +1047,7 @@ void TDBIN::parse() {
 	scene.palettes.resize(palette_count);
 	for (int i = 0; i < palette_count; i++)
 		scene.palettes[i] = ReadPalette();
+	MapPalettes();
 
 	entries = ReadInt();
 	scene.registry.resize(entries);
@@ -972,6 +1074,8 @@ void ParseFile(ConverterParams params) {
 	}
 	create_folder(params.map_folder);
 	create_folder(params.map_folder + (params.legacy_format ? "custom" : "vox"));
+	if (params.use_prefabs && !params.legacy_format)
+		create_folder(params.map_folder + "prefab");
 	progress = 0.25;
 	printf("Generating XML file...\n");
 	parser.WriteScene();
@@ -981,6 +1085,7 @@ void ParseFile(ConverterParams params) {
 	parser.WritePostProcessing();
 	progress = 0.5;
 	parser.WriteEntities();
+	parser.WritePrefabs();
 	printf("Saving XML file...\n");
 	parser.SaveXML();
 	progress = 0.75;
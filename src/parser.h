@@ -5,10 +5,11 @@
 #include <stdio.h>
 #include <atomic>
 #include <string>
-#include <map>
+#include <vector>
 
 #include "scene.h"
 #include "binary_reader.h"
+#include "handle_map.h"
 
 using namespace std;
 
@@ -30,6 +31,18 @@ struct ConverterParams {
 	bool legacy_format = false;
 
 	int transform_precision = 2;
+
+	// Split palette .vox files, 0 disables each rule
+	int vox_max_models = 0;		// Models per file
+	int vox_max_bytes = 0;		// Bytes of model data per file
+	float vox_cell_size = 0;	// Size in meters of the XZ world cells sharing a file
+	bool incremental_vox = false;	// Only rewrite .vox files that changed since the last conversion
+	bool use_prefabs = false;		// Save repeated bodies and vehicles once, as prefab instances
+	bool keep_shape_extents = false;	// Do not crop the air around the voxels of shapes
+	bool keep_disconnected_shapes = false;	// Do not split shapes flagged as disconnected into their islands
+	int merge_shape_volume = 0;		// Merge aligned shapes of static bodies up to this many voxels, 0 disables
+
+	int threads = 4;	// Threads writing the XML of top-level entities, 1 writes everything on the calling thread
 };
 
 void ParseFile(ConverterParams params);
@@ -38,41 +51,46 @@ class TDBIN : public FileReader {
 protected:
 	Scene scene;
 	int tdbin_version = 0;
-	map<uint32_t, Entity*> entity_mapping;
+	HandleMap<Entity> entity_mapping;
+	vector<uint32_t> palette_mapping; // Palette id to the first palette with the same materials
+	void ReadScriptVariables(ScriptCore& core);
 private:
+	vector<LuaTableEntry> lua_entries; // Entries of the Lua tables being read
+	void MapPalettes();
 	Fire ReadFire();
 	Rope* ReadRope();
 	Voxels ReadVoxels();
 	Palette ReadPalette();
 	ToolInfo ReadToolInfo();
-	ScriptCore ReadScriptCore();
+	void ReadScriptCore(ScriptCore& core);
 	VehicleProperties ReadVehicleProperties();
-	LuaValue ReadLuaValue(LuaType key_type);
-	LuaTable* ReadLuaTable();
+	LuaValue ReadLuaValue(LuaType key_type, LuaTable& table);
+	uint32_t ReadLuaTable(LuaTable& table);
+	void SkipLuaValue(LuaType key_type);
+	void SkipLuaTable();
 
 	Entity* ReadEntity();
-	Body* ReadBody();
-	Shape* ReadShape();
-	Light* ReadLight();
-	Location* ReadLocation();
-	Water* ReadWater();
-	Joint* ReadJoint();
-	Vehicle* ReadVehicle();
-	Wheel* ReadWheel();
-	Screen* ReadScreen();
-	Trigger* ReadTrigger();
-	Script* ReadScript();
-	Animator* ReadAnimator();
-	Rig* ReadRig();
+	Body* ReadBody(Entity* entity);
+	Shape* ReadShape(Entity* entity);
+	Light* ReadLight(Entity* entity);
+	Location* ReadLocation(Entity* entity);
+	Water* ReadWater(Entity* entity);
+	Joint* ReadJoint(Entity* entity);
+	Vehicle* ReadVehicle(Entity* entity);
+	Wheel* ReadWheel(Entity* entity);
+	Screen* ReadScreen(Entity* entity);
+	Trigger* ReadTrigger(Entity* entity);
+	Script* ReadScript(Entity* entity);
+	Animator* ReadAnimator(Entity* entity);
+	Rig* ReadRig(Entity* entity);
 
 	void ReadPostProcessing();
 	void ReadPlayers();
 	void ReadEnvironment();
-	void* ReadEntityType(uint8_t type);
+	void ReadEntityType(Entity* entity);
 public:
 	TDBIN();
 	void InitScene(string input);
-	~TDBIN();
 	void parse();
 };
 
@@ -4,7 +4,9 @@
 #include <stdint.h>
 #include <string>
 
+#include "arena.h"
 #include "entity.h"
+#include "entity_pool.h"
 
 using namespace std;
 
@@ -189,6 +191,7 @@ struct Projectile {
 };
 
 struct Scene {
+	Arena arena; // Entities, ropes and anything else they point to, released with the scene
 	char magic[5];
 	uint8_t version[3];
 	string level_id;
@@ -222,6 +225,21 @@ struct Scene {
 	Vec<Registry> registry;
 	Vec<Entity*> entities;
 	// ...
+
+	// Objects of each entity type, found by the type and index of their entity
+	EntityPool<Body> bodies;
+	EntityPool<Shape> shapes;
+	EntityPool<Light> lights;
+	EntityPool<Location> locations;
+	EntityPool<Water> waters;
+	EntityPool<Joint> joints;
+	EntityPool<Vehicle> vehicles;
+	EntityPool<Wheel> wheels;
+	EntityPool<Screen> screens;
+	EntityPool<Trigger> triggers;
+	EntityPool<Script> scripts;
+	EntityPool<Animator> animators;
+	EntityPool<Rig> rigs;
 };
 
 #endif
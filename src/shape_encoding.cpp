@@ -0,0 +1,358 @@
+#include <limits.h>
+#include <stdint.h>
+#include <vector>
+
+#include "math_utils.h"
+#include "shape_encoding.h"
+
+// Rough size in bytes of each part of the output
+static const float VOX_ELEMENT_BYTES = 200;		// <vox> or <compound> with transform, file and object
+static const float VOXBOX_ELEMENT_BYTES = 200;	// <voxbox> with transform, size, material and color
+static const float PART_ELEMENT_BYTES = 80;		// <vox> part of a compound
+static const float MODEL_BYTES = 100;			// SIZE, XYZI, nTRN and nSHP chunks of a model
+static const float VOXEL_BYTES = 4;				// XYZI entry
+// Load cost, in equivalent bytes, of each voxel of the shapes the game creates
+static const float GRID_VOXEL_COST = 0.05;
+
+static const int MAX_MODEL_SIZE = 256;
+
+// Bounds of a set of voxels, max is exclusive
+struct Bounds {
+	int min[3];
+	int max[3];
+};
+
+static void ClearBounds(Bounds& bounds) {
+	for (int axis = 0; axis < 3; axis++) {
+		bounds.min[axis] = INT_MAX;
+		bounds.max[axis] = INT_MIN;
+	}
+}
+
+static void AddToBounds(Bounds& bounds, int x, int y, int z, int sizex, int sizey, int sizez) {
+	const int min[3] = { x, y, z };
+	const int max[3] = { x + sizex, y + sizey, z + sizez };
+	for (int axis = 0; axis < 3; axis++) {
+		if (min[axis] < bounds.min[axis])
+			bounds.min[axis] = min[axis];
+		if (max[axis] > bounds.max[axis])
+			bounds.max[axis] = max[axis];
+	}
+}
+
+static void AddToBounds(Bounds& bounds, const Bounds& other) {
+	if (other.min[0] < other.max[0])
+		AddToBounds(bounds, other.min[0], other.min[1], other.min[2],
+					other.max[0] - other.min[0], other.max[1] - other.min[1], other.max[2] - other.min[2]);
+}
+
+static float VoxboxCost(int volume) {
+	return VOXBOX_ELEMENT_BYTES + GRID_VOXEL_COST * volume;
+}
+
+// A vox if it fits in a single model, a compound otherwise
+static float ModelCost(int sizex, int sizey, int sizez, int voxel_count, bool& is_compound) {
+	float volume = (float)sizex * sizey * sizez;
+	is_compound = sizex > MAX_MODEL_SIZE || sizey > MAX_MODEL_SIZE || sizez > MAX_MODEL_SIZE;
+	if (!is_compound)
+		return VOX_ELEMENT_BYTES + MODEL_BYTES + VOXEL_BYTES * voxel_count + GRID_VOXEL_COST * volume;
+	int parts = ((sizex + MAX_MODEL_SIZE - 1) / MAX_MODEL_SIZE) *
+				((sizey + MAX_MODEL_SIZE - 1) / MAX_MODEL_SIZE) *
+				((sizez + MAX_MODEL_SIZE - 1) / MAX_MODEL_SIZE);
+	return VOX_ELEMENT_BYTES + parts * (PART_ELEMENT_BYTES + MODEL_BYTES) +
+		   VOXEL_BYTES * voxel_count + GRID_VOXEL_COST * volume;
+}
+
+// Layers of the shape perpendicular to each axis that are completely filled
+// with a single index. Each layer holds the index, or 0 if it is not uniform,
+// and the bounds of its voxels.
+static void GetUniformLayers(const Tensor3D& voxels, int excluded_index, vector<int> layers[3], vector<Bounds> layer_bounds[3], int& voxel_count) {
+	const int sizes[3] = { voxels.sizex, voxels.sizey, voxels.sizez };
+	Bounds empty;
+	ClearBounds(empty);
+	for (int axis = 0; axis < 3; axis++) {
+		layers[axis].assign(sizes[axis], -1);
+		layer_bounds[axis].assign(sizes[axis], empty);
+	}
+
+	const uint8_t* data = voxels.ToArray();
+	voxel_count = 0;
+	for (int z = 0; z < voxels.sizez; z++)
+		for (int y = 0; y < voxels.sizey; y++)
+			for (int x = 0; x < voxels.sizex; x++) {
+				int index = *data++;
+				const int coords[3] = { x, y, z };
+				if (index != 0) {
+					voxel_count++;
+					for (int axis = 0; axis < 3; axis++)
+						AddToBounds(layer_bounds[axis][coords[axis]], x, y, z, 1, 1, 1);
+				}
+				if (index == excluded_index)
+					index = 0;
+				for (int axis = 0; axis < 3; axis++) {
+					int& layer = layers[axis][coords[axis]];
+					if (layer == -1)
+						layer = index;
+					else if (layer != index)
+						layer = 0;
+				}
+			}
+}
+
+// Runs of consecutive layers with the same index become voxboxes, if that is
+// cheaper than keeping their voxels in the model. The model of the remaining
+// voxels is priced cropped to the layers left.
+static ShapeEncoding GetLayerBoxes(const Tensor3D& voxels, const vector<int>& layers, const vector<Bounds>& layer_bounds, int axis, int voxel_count) {
+	const int sizes[3] = { voxels.sizex, voxels.sizey, voxels.sizez };
+	int layer_volume = sizes[0] * sizes[1] * sizes[2] / sizes[axis];
+
+	ShapeEncoding encoding;
+	encoding.type = ShapeEncoding::Boxes;
+	encoding.remaining_voxels = voxel_count;
+	encoding.cost = 0;
+	Bounds remaining;
+	ClearBounds(remaining);
+	int start = 0;
+	while (start < sizes[axis]) {
+		int end = start + 1;
+		while (end < sizes[axis] && layers[end] == layers[start])
+			end++;
+		int box_volume = (end - start) * layer_volume;
+		if (layers[start] > 0 && VOXEL_BYTES * box_volume > VoxboxCost(box_volume)) {
+			int box_pos[3] = { 0, 0, 0 };
+			int box_size[3] = { sizes[0], sizes[1], sizes[2] };
+			box_pos[axis] = start;
+			box_size[axis] = end - start;
+			VoxelBox box = { box_pos[0], box_pos[1], box_pos[2], box_size[0], box_size[1], box_size[2], (uint8_t)layers[start] };
+			encoding.boxes.push_back(box);
+			encoding.remaining_voxels -= box_volume;
+			encoding.cost += VoxboxCost(box_volume);
+		} else
+			for (int i = start; i < end; i++)
+				AddToBounds(remaining, layer_bounds[i]);
+		start = end;
+	}
+
+	if (encoding.remaining_voxels > 0) {
+		bool is_compound;
+		encoding.cost += ModelCost(remaining.max[0] - remaining.min[0], remaining.max[1] - remaining.min[1],
+								   remaining.max[2] - remaining.min[2], encoding.remaining_voxels, is_compound);
+	}
+	return encoding;
+}
+
+// Grows boxes of a single index from each voxel not covered yet, first along
+// x, then y, then z. Boxes too small to be worth a voxbox stay in the model,
+// which is priced cropped to the voxels left.
+static ShapeEncoding GetGreedyBoxes(const Tensor3D& voxels, int excluded_index, int voxel_count) {
+	int sizex = voxels.sizex;
+	int sizey = voxels.sizey;
+	int sizez = voxels.sizez;
+	const uint8_t* data = voxels.ToArray();
+	vector<bool> visited(voxels.GetVolume(), false);
+
+	ShapeEncoding encoding;
+	encoding.type = ShapeEncoding::Boxes;
+	encoding.remaining_voxels = voxel_count;
+	encoding.cost = 0;
+	Bounds remaining;
+	ClearBounds(remaining);
+	for (int z = 0; z < sizez; z++)
+		for (int y = 0; y < sizey; y++)
+			for (int x = 0; x < sizex; x++) {
+				int start = x + sizex * (y + sizey * z);
+				uint8_t index = data[start];
+				if (index == 0 || visited[start])
+					continue;
+				if (index == excluded_index) {
+					AddToBounds(remaining, x, y, z, 1, 1, 1);
+					continue;
+				}
+
+				int box_sizex = 1;
+				while (x + box_sizex < sizex && data[start + box_sizex] == index && !visited[start + box_sizex])
+					box_sizex++;
+
+				int box_sizey = 1;
+				bool can_grow = true;
+				while (can_grow && y + box_sizey < sizey) {
+					int row = start + sizex * box_sizey;
+					for (int i = 0; i < box_sizex && can_grow; i++)
+						can_grow = data[row + i] == index && !visited[row + i];
+					if (can_grow)
+						box_sizey++;
+				}
+
+				int box_sizez = 1;
+				can_grow = true;
+				while (can_grow && z + box_sizez < sizez) {
+					int layer = start + sizex * sizey * box_sizez;
+					for (int j = 0; j < box_sizey && can_grow; j++)
+						for (int i = 0; i < box_sizex && can_grow; i++) {
+							int k = layer + sizex * j + i;
+							can_grow = data[k] == index && !visited[k];
+						}
+					if (can_grow)
+						box_sizez++;
+				}
+
+				for (int k = 0; k < box_sizez; k++)
+					for (int j = 0; j < box_sizey; j++)
+						for (int i = 0; i < box_sizex; i++)
+							visited[start + i + sizex * (j + sizey * k)] = true;
+
+				int box_volume = box_sizex * box_sizey * box_sizez;
+				if (VOXEL_BYTES * box_volume > VoxboxCost(box_volume)) {
+					VoxelBox box = { x, y, z, box_sizex, box_sizey, box_sizez, index };
+					encoding.boxes.push_back(box);
+					encoding.remaining_voxels -= box_volume;
+					encoding.cost += VoxboxCost(box_volume);
+				} else
+					AddToBounds(remaining, x, y, z, box_sizex, box_sizey, box_sizez);
+			}
+
+	if (encoding.remaining_voxels > 0) {
+		bool is_compound;
+		encoding.cost += ModelCost(remaining.max[0] - remaining.min[0], remaining.max[1] - remaining.min[1],
+								   remaining.max[2] - remaining.min[2], encoding.remaining_voxels, is_compound);
+	}
+	return encoding;
+}
+
+ShapeEncoding ChooseShapeEncoding(const Tensor3D& voxels, bool allow_voxbox, bool allow_boxes, int excluded_index) {
+	ShapeEncoding best;
+	best.remaining_voxels = 0;
+	if (allow_voxbox && voxels.IsFilledSingleColor()) {
+		best.type = ShapeEncoding::Voxbox;
+		best.cost = VoxboxCost(voxels.GetVolume());
+		return best;
+	}
+
+	// Without voxboxes the size decides, the cost assumes all voxels are used
+	bool is_compound;
+	if (!allow_voxbox || !allow_boxes) {
+		best.cost = ModelCost(voxels.sizex, voxels.sizey, voxels.sizez, voxels.GetVolume(), is_compound);
+		best.type = is_compound ? ShapeEncoding::Compound : ShapeEncoding::Vox;
+		return best;
+	}
+
+	vector<int> layers[3];
+	vector<Bounds> layer_bounds[3];
+	int voxel_count;
+	GetUniformLayers(voxels, excluded_index, layers, layer_bounds, voxel_count);
+	best.cost = ModelCost(voxels.sizex, voxels.sizey, voxels.sizez, voxel_count, is_compound);
+	best.type = is_compound ? ShapeEncoding::Compound : ShapeEncoding::Vox;
+	best.remaining_voxels = voxel_count;
+
+	for (int axis = 0; axis < 3; axis++) {
+		ShapeEncoding encoding = GetLayerBoxes(voxels, layers[axis], layer_bounds[axis], axis, voxel_count);
+		if (!encoding.boxes.empty() && encoding.cost < best.cost)
+			best = encoding;
+	}
+	// Also covers regions that do not span the whole shape
+	ShapeEncoding encoding = GetGreedyBoxes(voxels, excluded_index, voxel_count);
+	if (!encoding.boxes.empty() && encoding.cost < best.cost)
+		best = encoding;
+	return best;
+}
+
+// Halves the region along every axis longer than a model, like an octree,
+// until the voxels in each region fit in one
+static void SplitRegion(const Tensor3D& voxels, const int region_min[3], const int region_max[3], vector<VoxelBox>& parts) {
+	int min[3], max[3];
+	if (!voxels.GetBounds(region_min, region_max, min, max))
+		return;
+	bool split[3];
+	for (int axis = 0; axis < 3; axis++)
+		split[axis] = max[axis] - min[axis] > MAX_MODEL_SIZE;
+	if (!split[0] && !split[1] && !split[2]) {
+		VoxelBox part = { min[0], min[1], min[2], max[0] - min[0], max[1] - min[1], max[2] - min[2], 0 };
+		parts.push_back(part);
+		return;
+	}
+
+	for (int octant = 0; octant < 8; octant++) {
+		int child_min[3], child_max[3];
+		bool skip = false;
+		for (int axis = 0; axis < 3 && !skip; axis++) {
+			bool upper = (octant >> axis) & 1;
+			if (!split[axis]) {
+				skip = upper;
+				child_min[axis] = min[axis];
+				child_max[axis] = max[axis];
+			} else {
+				int middle = (min[axis] + max[axis]) / 2;
+				child_min[axis] = upper ? middle : min[axis];
+				child_max[axis] = upper ? max[axis] : middle;
+			}
+		}
+		if (!skip)
+			SplitRegion(voxels, child_min, child_max, parts);
+	}
+}
+
+void SplitCompound(const Tensor3D& voxels, vector<VoxelBox>& parts) {
+	const int region_min[3] = { 0, 0, 0 };
+	const int region_max[3] = { voxels.sizex, voxels.sizey, voxels.sizez };
+	SplitRegion(voxels, region_min, region_max, parts);
+}
+
+void SplitComponents(const Tensor3D& voxels, vector<Tensor3D>& components, vector<VoxelBox>& bounds) {
+	int sizex = voxels.sizex;
+	int sizey = voxels.sizey;
+	int sizez = voxels.sizez;
+	const int sizes[3] = { sizex, sizey, sizez };
+	const int strides[3] = { 1, sizex, sizex * sizey };
+	int volume = voxels.GetVolume();
+	int voxel_count = voxels.GetNonZeroCount();
+	const uint8_t* data = voxels.ToArray();
+	vector<bool> visited(volume, false);
+	vector<int> component;
+	vector<int> stack;
+
+	for (int start = 0; start < volume; start++) {
+		if (data[start] == 0 || visited[start])
+			continue;
+
+		// Flood fill from the first voxel not visited yet
+		int min[3] = { sizex, sizey, sizez };
+		int max[3] = { 0, 0, 0 };
+		component.clear();
+		visited[start] = true;
+		stack.push_back(start);
+		while (!stack.empty()) {
+			int i = stack.back();
+			stack.pop_back();
+			component.push_back(i);
+			const int coords[3] = { i % sizex, (i / sizex) % sizey, i / strides[2] };
+			for (int axis = 0; axis < 3; axis++) {
+				if (coords[axis] < min[axis])
+					min[axis] = coords[axis];
+				if (coords[axis] + 1 > max[axis])
+					max[axis] = coords[axis] + 1;
+			}
+
+			for (int axis = 0; axis < 3; axis++) {
+				if (coords[axis] > 0 && data[i - strides[axis]] != 0 && !visited[i - strides[axis]]) {
+					visited[i - strides[axis]] = true;
+					stack.push_back(i - strides[axis]);
+				}
+				if (coords[axis] + 1 < sizes[axis] && data[i + strides[axis]] != 0 && !visited[i + strides[axis]]) {
+					visited[i + strides[axis]] = true;
+					stack.push_back(i + strides[axis]);
+				}
+			}
+		}
+		if (components.empty() && (int)component.size() == voxel_count)
+			return;
+
+		VoxelBox box = { min[0], min[1], min[2], max[0] - min[0], max[1] - min[1], max[2] - min[2], 0 };
+		Tensor3D part(box.sizex, box.sizey, box.sizez);
+		for (unsigned int j = 0; j < component.size(); j++) {
+			int i = component[j];
+			part.Set(i % sizex - box.x, (i / sizex) % sizey - box.y, i / strides[2] - box.z, data[i]);
+		}
+		components.push_back(part);
+		bounds.push_back(box);
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef SHAPE_ENCODING_H
+#define SHAPE_ENCODING_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "math_utils.h"
+
+using namespace std;
+
+// Box of voxels with the same palette index, in shape coordinates
+struct VoxelBox {
+	int x, y, z;
+	int sizex, sizey, sizez;
+	uint8_t index;
+};
+
+// How a shape is written to main.xml and the .vox files
+struct ShapeEncoding {
+	enum Type { Voxbox, Vox, Compound, Boxes };
+	Type type;
+	vector<VoxelBox> boxes;		// Voxboxes of the Boxes encoding
+	int remaining_voxels;		// Voxels not covered by the boxes, written as a vox or compound
+	float cost;					// Estimated output bytes plus load cost
+};
+
+// Estimates the cost of each encoding of the shape and returns the cheapest.
+// Voxboxes are only used if allowed, never for air or the excluded index.
+// Splitting the shape into several voxboxes needs allow_boxes too.
+ShapeEncoding ChooseShapeEncoding(const Tensor3D& voxels, bool allow_voxbox, bool allow_boxes, int excluded_index);
+
+// Splits the occupied space of a shape into boxes of at most 256 voxels per
+// side, for the parts of a compound. Empty regions get no part. The index of
+// the boxes is not used.
+void SplitCompound(const Tensor3D& voxels, vector<VoxelBox>& parts);
+
+// Splits the voxels into groups connected through their faces, each cropped
+// to its bounds. Leaves components empty if all the voxels are connected.
+// The index of the bounds is not used.
+void SplitComponents(const Tensor3D& voxels, vector<Tensor3D>& components, vector<VoxelBox>& bounds);
+
+#endif
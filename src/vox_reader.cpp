@@ -0,0 +1,90 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "math_utils.h"
+#include "scene.h"
+#include "vox_reader.h"
+
+static const char* MANIFEST_HEADER = "TDMANIFEST";
+static const int MANIFEST_VERSION = 2;
+
+// Reads the SIZE chunk at the given offset and the XYZI or TDCZ chunk following it
+bool ReadModelChunks(string path, long int offset, vector<uint8_t>& chunks) {
+	FILE* vox_file = fopen(path.c_str(), "rb");
+	if (vox_file == nullptr)
+		return false;
+
+	bool valid = false;
+	int size_header[3];
+	int size_content[3];
+	int voxels_header[3];
+	if (fseek(vox_file, offset, SEEK_SET) == 0 &&
+		fread(size_header, sizeof(int), 3, vox_file) == 3 && size_header[0] == SIZE && size_header[1] == 12 &&
+		fread(size_content, sizeof(int), 3, vox_file) == 3 &&
+		fread(voxels_header, sizeof(int), 3, vox_file) == 3 &&
+		(voxels_header[0] == XYZI || voxels_header[0] == TDCZ) && voxels_header[1] >= 0) {
+		size_t header_size = sizeof(size_header) + sizeof(size_content) + sizeof(voxels_header);
+		chunks.resize(header_size + voxels_header[1]);
+		uint8_t* data = chunks.data();
+		memcpy(data, size_header, sizeof(size_header));
+		memcpy(data + sizeof(size_header), size_content, sizeof(size_content));
+		memcpy(data + sizeof(size_header) + sizeof(size_content), voxels_header, sizeof(voxels_header));
+		valid = fread(data + header_size, sizeof(uint8_t), voxels_header[1], vox_file) == (size_t)voxels_header[1];
+	}
+	fclose(vox_file);
+	return valid;
+}
+
+bool LoadManifest(string path, MV_Manifest& manifest) {
+	FILE* manifest_file = fopen(path.c_str(), "r");
+	if (manifest_file == nullptr)
+		return false;
+
+	char header[16];
+	int version = 0;
+	bool valid = fscanf(manifest_file, "%15s %d", header, &version) == 2 &&
+				 string(header) == MANIFEST_HEADER && version == MANIFEST_VERSION;
+
+	char name[256];
+	int compress = 0;
+	int model_count = 0;
+	MV_ManifestFile entry;
+	while (valid && fscanf(manifest_file, " file %255s %d %" SCNx64 " %ld %ld %" SCNx64 " %d", name, &compress,
+						   &entry.palette_hash, &entry.data_size, &entry.file_size, &entry.file_hash, &model_count) == 7) {
+		entry.compress = compress != 0;
+		entry.models.resize(model_count);
+		for (int i = 0; i < model_count && valid; i++) {
+			MV_Model& model = entry.models[i];
+			char model_name[256];
+			valid = fscanf(manifest_file, "%255s %" SCNx64 " %d %ld %d %d %d %d %d %d", model_name, &model.hash,
+						   &model.handle, &model.offset, &model.pos_x, &model.pos_y, &model.pos_z,
+						   &model.sizex, &model.sizey, &model.sizez) == 10;
+			model.name = model_name;
+		}
+		if (valid)
+			manifest[name] = entry;
+	}
+	fclose(manifest_file);
+	if (!valid)
+		manifest.clear();
+	return valid;
+}
+
+// Hash of the content of the file, to detect edits that keep its size
+bool HashFile(string path, uint64_t& hash) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr)
+		return false;
+	uint8_t buffer[65536];
+	hash = HASH_SEED;
+	size_t read;
+	while ((read = fread(buffer, sizeof(uint8_t), sizeof(buffer), file)) > 0)
+		hash = HashBytes(buffer, read, hash);
+	bool valid = ferror(file) == 0;
+	fclose(file);
+	return valid;
+}
@@ -0,0 +1,16 @@
+#ifndef VOX_READER_H
+#define VOX_READER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "vox_writer.h"
+
+using namespace std;
+
+bool ReadModelChunks(string path, long int offset, vector<uint8_t>& chunks);
+bool LoadManifest(string path, MV_Manifest& manifest);
+bool HashFile(string path, uint64_t& hash);
+
+#endif
@@ -1,6 +1,7 @@
-#include <iomanip>
+#include <algorithm>
+#include <bitset>
+#include <inttypes.h>
 #include <math.h>
-#include <sstream>
 #include <stdexcept>
 #include <stdint.h>
 #include <string.h>
@@ -9,6 +10,7 @@
 
 #include "misc_utils.h"
 #include "scene.h"
+#include "vox_reader.h"
 #include "vox_writer.h"
 #include "zlib_utils.h"
 
@@ -20,18 +22,37 @@ static const char* td_notes[32] = {
 	"metal",	 "plaster",		"plaster",	  "masonry",	"masonry",	"masonry",	  "masonry",	"wood",
 	"wood",		 "rock",		"rock",		  "dirt",		"dirt",		"foliage",	  "foliage",	"glass"};
 
-static string FloatToString(float value) {
-	if (fabs(value) < 0.0005)
-		value = 0;
-	ostringstream ss;
-	ss << fixed << setprecision(2) << value;
-	string str = ss.str();
-	if (str.find('.') != string::npos) {
-		str.erase(str.find_last_not_of('0') + 1);
-		if (str.back() == '.')
-			str.pop_back();
+// Material of each row in td_notes, the first row is treated as none
+static const int NO_MATERIAL = -1;
+static constexpr int td_row_material[32] = {
+	Material::None,		   NO_MATERIAL,			  Material::Unphysical, Material::Unphysical,
+	NO_MATERIAL,		   NO_MATERIAL,			  NO_MATERIAL,			NO_MATERIAL,
+	Material::Ice,		   Material::HardMasonry, Material::HardMetal,	Material::Plastic,
+	Material::Plastic,	   Material::HeavyMetal,  Material::HeavyMetal, Material::Metal,
+	Material::Metal,	   Material::Plaster,	  Material::Plaster,	Material::Masonry,
+	Material::Masonry,	   Material::Masonry,	  Material::Masonry,	Material::Wood,
+	Material::Wood,		   Material::Rock,		  Material::Rock,		Material::Dirt,
+	Material::Dirt,		   Material::Foliage,	  Material::Foliage,	Material::Glass};
+
+void SaveManifest(string path, const MV_Manifest& manifest) {
+	FILE* manifest_file = fopen(path.c_str(), "w");
+	if (manifest_file == nullptr) {
+		printf("[ERROR] Could not open %s for writing\n", path.c_str());
+		return;
+	}
+	fprintf(manifest_file, "TDMANIFEST 2\n");
+	for (MV_Manifest::const_iterator it = manifest.begin(); it != manifest.end(); it++) {
+		const MV_ManifestFile& entry = it->second;
+		fprintf(manifest_file, "file %s %d %016" PRIx64 " %ld %ld %016" PRIx64 " %d\n", it->first.c_str(), entry.compress ? 1 : 0,
+				entry.palette_hash, entry.data_size, entry.file_size, entry.file_hash, (int)entry.models.size());
+		for (unsigned int i = 0; i < entry.models.size(); i++) {
+			const MV_Model& model = entry.models[i];
+			fprintf(manifest_file, "%s %016" PRIx64 " %d %ld %d %d %d %d %d %d\n", model.name.c_str(), model.hash,
+					model.handle, model.offset, model.pos_x, model.pos_y, model.pos_z,
+					model.sizex, model.sizey, model.sizez);
+		}
 	}
-	return str;
+	fclose(manifest_file);
 }
 
 bool MV_Shape::operator==(const MV_Shape& other) const {
@@ -45,10 +66,19 @@ bool MV_Shape::operator==(const MV_Shape& other) const {
 	return true;
 }
 
-MV_FILE::MV_FILE(string filename, bool write_imap) {
+MV_FILE::MV_FILE(string filename, bool write_imap, bool compress) {
 	this->filename = filename;
 	this->write_imap = write_imap;
+	this->compress = compress;
 	vox_file = nullptr;
+	children_size_ptr = 0;
+	data_size = 0;
+	file_size = 0;
+	header_written = false;
+	previous = nullptr;
+	write_path = filename;
+	is_writing = true;
+	unchanged_models = 0;
 
 	for (int i = 0; i < 256; i++) {
 		palette[i] = {75, 75, 75, 255};
@@ -124,7 +154,6 @@ void MV_FILE::WriteTDCZ(const MV_Shape& shape) {
 		fwrite(compressed_data.data(), sizeof(uint8_t), compressed_data.size(), vox_file);
 	} else
 		printf("[WARNING] Failed to compress shape %s\n", shape.name.c_str());
-	delete[] voxel_array;
 }
 
 void MV_FILE::Write_nSHP(int i) {
@@ -205,16 +234,16 @@ void MV_FILE::WriteMATL(uint8_t index, const MV_Material& mat) {
 	DICT material_attr;
 	if (mat.type == METAL) {
 		material_attr["_type"] = "_metal";
-		material_attr["_rough"] = FloatToString(mat.properties.metal.roughness);
-		material_attr["_sp"] = FloatToString(mat.properties.metal.specular);
-		material_attr["_metal"] = FloatToString(mat.properties.metal.metallic);
+		material_attr["_rough"] = FloatToString(mat.properties.metal.roughness, 2);
+		material_attr["_sp"] = FloatToString(mat.properties.metal.specular, 2);
+		material_attr["_metal"] = FloatToString(mat.properties.metal.metallic, 2);
 	} else if (mat.type == GLASS) {
 		material_attr["_type"] = "_glass";
-		material_attr["_rough"] = FloatToString(mat.properties.glass.roughness);
+		material_attr["_rough"] = FloatToString(mat.properties.glass.roughness, 2);
 		material_attr["_alpha"] = "0.5";
 	} else if (mat.type == EMIT) {
 		material_attr["_type"] = "_emit";
-		material_attr["_emit"] = FloatToString(mat.properties.emit.emission);
+		material_attr["_emit"] = FloatToString(mat.properties.emit.emission, 2);
 		material_attr["_flux"] = to_string(mat.properties.emit.power);
 	} else
 		return;
@@ -240,21 +269,31 @@ void MV_FILE::WriteNOTE() {
 	}
 }
 
-void MV_FILE::SaveModel(bool compress) {
-	vox_file = fopen(filename.c_str(), "wb+");
-	if (vox_file == nullptr) {
-		printf("[ERROR] Could not open %s for writing\n", filename.c_str());
-		return;
+MV_FILE::~MV_FILE() {
+	CloseFile();
+}
+
+void MV_FILE::SaveModel() {
+	if (!is_writing) {
+		// Keep the file from the previous conversion if nothing changed
+		if (unchanged_models == (int)previous->models.size() && previous->palette_hash == GetPaletteHash()) {
+			file_size = previous->file_size;
+			return;
+		}
+		StartWriting();
 	}
 
-	WriteFileHeader();
-	for (unsigned int i = 0; i < models.size(); i++) {
-		WriteSIZE(models[i]);
-		if (compress)
-			WriteTDCZ(models[i]);
-		else
-			WriteXYZI(models[i]);
+	// SIZE and XYZI/TDCZ chunks were already written by AddShape
+	CloseFile();
+	vox_file = fopen(write_path.c_str(), header_written ? "rb+" : "wb+");
+	if (vox_file == nullptr) {
+		printf("[ERROR] Could not open %s for writing\n", write_path.c_str());
+		return;
 	}
+	if (!header_written)
+		WriteFileHeader();
+	else
+		fseek(vox_file, 0, SEEK_END);
 
 	WriteChunkHeader(nTRN, 28, 0);
 	WriteInt(0);  // node_id
@@ -278,20 +317,148 @@ void MV_FILE::SaveModel(bool compress) {
 	fseek(vox_file, children_size_ptr, SEEK_SET);
 	WriteInt(size - children_size_ptr - sizeof(int)); // Minus 4 bytes of childrenSize
 	fclose(vox_file);
+	vox_file = nullptr;
+	file_size = size;
+
+	if (write_path != filename) {
+		remove(filename.c_str());
+		if (rename(write_path.c_str(), filename.c_str()) != 0)
+			printf("[ERROR] Could not replace %s\n", filename.c_str());
+	}
+}
+
+vector<MV_FILE*> MV_FILE::open_files;
+
+bool MV_FILE::OpenForAppend() {
+	if (vox_file != nullptr) {
+		vector<MV_FILE*>::iterator it = find(open_files.begin(), open_files.end(), this);
+		open_files.erase(it);
+		open_files.push_back(this);
+		return true;
+	}
+	if (open_files.size() >= MAX_OPEN_FILES)
+		open_files.front()->CloseFile();
+
+	vox_file = fopen(write_path.c_str(), header_written ? "ab" : "wb");
+	if (vox_file == nullptr) {
+		printf("[ERROR] Could not open %s for writing\n", write_path.c_str());
+		return false;
+	}
+	// The position of a file opened for appending is not always at the end
+	fseek(vox_file, 0, SEEK_END);
+	open_files.push_back(this);
+	if (!header_written)
+		WriteFileHeader();
+	header_written = true;
+	return true;
+}
+
+void MV_FILE::CloseFile() {
+	if (vox_file == nullptr)
+		return;
+	fclose(vox_file);
+	vox_file = nullptr;
+	vector<MV_FILE*>::iterator it = find(open_files.begin(), open_files.end(), this);
+	if (it != open_files.end())
+		open_files.erase(it);
+}
+
+// Rewrite the models matched so far, copying them from the previous file
+void MV_FILE::StartWriting() {
+	is_writing = true;
+	if (!OpenForAppend())
+		return;
+	for (int i = 0; i < unchanged_models; i++) {
+		models[i].offset = ftell(vox_file);
+		if (!CopyPreviousModel(previous->models[i]))
+			printf("[ERROR] Could not copy model %s from %s\n", models[i].name.c_str(), filename.c_str());
+	}
+	data_size = ftell(vox_file);
+}
+
+bool MV_FILE::CopyPreviousModel(const MV_Model& previous_model) {
+	vector<uint8_t> chunks;
+	if (!ReadModelChunks(filename, previous_model.offset, chunks))
+		return false;
+	fwrite(chunks.data(), sizeof(uint8_t), chunks.size(), vox_file);
+	return true;
 }
 
 void MV_FILE::AddShape(const MV_Shape& shape) {
-	models.push_back(shape);
+	AddShape(shape, shape.voxels.GetHash());
+}
+
+void MV_FILE::AddShape(const MV_Shape& shape, uint64_t hash) {
+	const Tensor3D& voxels = shape.voxels;
+	MV_Model model = { shape.name, shape.pos_x, shape.pos_y, shape.pos_z,
+					   voxels.sizex, voxels.sizey, voxels.sizez, hash, shape.handle, 0 };
+
+	if (!is_writing) {
+		if (unchanged_models < (int)previous->models.size()) {
+			const MV_Model& expected = previous->models[unchanged_models];
+			if (expected.name == model.name && expected.hash == model.hash &&
+				expected.pos_x == model.pos_x && expected.pos_y == model.pos_y && expected.pos_z == model.pos_z &&
+				expected.sizex == model.sizex && expected.sizey == model.sizey && expected.sizez == model.sizez) {
+				unchanged_models++;
+				model.offset = expected.offset;
+				if (unchanged_models < (int)previous->models.size())
+					data_size = previous->models[unchanged_models].offset;
+				else
+					data_size = previous->data_size;
+				models.push_back(model);
+				return;
+			}
+		}
+		StartWriting();
+	}
+
+	if (!OpenForAppend())
+		return;
+	model.offset = ftell(vox_file);
+
+	// Reuse the chunks of an identical model from the previous conversion
+	bool copied = false;
+	if (previous != nullptr) {
+		map<uint64_t, int>::const_iterator it = previous_index.find(hash);
+		if (it != previous_index.end()) {
+			const MV_Model& previous_model = previous->models[it->second];
+			if (previous_model.sizex == voxels.sizex && previous_model.sizey == voxels.sizey &&
+				previous_model.sizez == voxels.sizez)
+				copied = CopyPreviousModel(previous_model);
+		}
+	}
+	if (!copied) {
+		WriteSIZE(shape);
+		if (compress)
+			WriteTDCZ(shape);
+		else
+			WriteXYZI(shape);
+	}
+	data_size = ftell(vox_file);
+	models.push_back(model);
 }
 
 bool MV_FILE::GetShapeName(const MV_Shape& shape, string& name) const {
-	bool found = false;
-	for (vector<MV_Shape>::const_iterator it = models.begin(); it != models.end() && !found; it++)
-		if (*it == shape) {
-			found = true;
+	return GetShapeName(shape, shape.voxels.GetHash(), name);
+}
+
+bool MV_FILE::GetShapeName(const MV_Shape& shape, uint64_t hash, string& name) const {
+	const Tensor3D& voxels = shape.voxels;
+	for (vector<MV_Model>::const_iterator it = models.begin(); it != models.end(); it++)
+		if (it->hash == hash && it->sizex == voxels.sizex && it->sizey == voxels.sizey && it->sizez == voxels.sizez) {
 			name = it->name;
+			return true;
 		}
-	return found;
+	return false;
+}
+
+int MV_FILE::GetModelCount() const {
+	return models.size();
+}
+
+// Bytes of model data written so far
+long int MV_FILE::GetDataSize() const {
+	return data_size;
 }
 
 void MV_FILE::SetEntry(uint8_t index, const MV_Color& color, MV_Material mat) {
@@ -302,28 +469,98 @@ void MV_FILE::SetEntry(uint8_t index, const MV_Color& color, MV_Material mat) {
 	is_index_used[index] = true;
 }
 
-string MV_FILE::GetIndexNote(int index) {
+// The previous file is only used if it was not modified since the manifest was written
+void MV_FILE::SetPrevious(const MV_ManifestFile* entry) {
+	if (entry->compress != compress)
+		return;
+	FILE* previous_file = fopen(filename.c_str(), "rb");
+	if (previous_file == nullptr)
+		return;
+	fseek(previous_file, 0, SEEK_END);
+	long int size = ftell(previous_file);
+	fclose(previous_file);
+	// Editing colors or materials keeps the size of the file
+	uint64_t hash;
+	if (size != entry->file_size || !HashFile(filename, hash) || hash != entry->file_hash)
+		return;
+
+	previous = entry;
+	previous_index.clear();
+	for (unsigned int i = 0; i < entry->models.size(); i++)
+		previous_index[entry->models[i].hash] = i;
+	write_path = filename + ".tmp";
+	is_writing = false;
+}
+
+// Reads the saved file back to hash it, unless it was kept from the previous conversion
+MV_ManifestFile MV_FILE::GetManifest() const {
+	uint64_t file_hash = 0;
+	if (!is_writing)
+		file_hash = previous->file_hash;
+	else if (!HashFile(filename, file_hash))
+		printf("[ERROR] Could not read %s\n", filename.c_str());
+	return { compress, GetPaletteHash(), data_size, file_size, file_hash, models };
+}
+
+// Hash of everything written after the models, except for the scene graph
+uint64_t MV_FILE::GetPaletteHash() const {
+	uint64_t hash = HashBytes(&write_imap, sizeof(write_imap));
+	for (int i = 0; i < 256; i++) {
+		hash = HashBytes(&is_index_used[i], sizeof(bool), hash);
+		hash = HashBytes(&palette[i], sizeof(MV_Color), hash);
+		if (!is_index_used[i])
+			continue;
+		const MV_Material& mat = material[i];
+		hash = HashBytes(&mat.td_type, sizeof(mat.td_type), hash);
+		hash = HashBytes(&mat.type, sizeof(mat.type), hash);
+		if (mat.type == METAL)
+			hash = HashBytes(&mat.properties.metal, sizeof(mat.properties.metal), hash);
+		else if (mat.type == GLASS)
+			hash = HashBytes(&mat.properties.glass, sizeof(mat.properties.glass), hash);
+		else if (mat.type == EMIT)
+			hash = HashBytes(&mat.properties.emit, sizeof(mat.properties.emit), hash);
+	}
+	return hash;
+}
+
+void MV_FILE::CopyEntries(const MV_FILE& other) {
+	for (int i = 0; i < 256; i++) {
+		palette[i] = other.palette[i];
+		material[i] = other.material[i];
+		is_index_used[i] = other.is_index_used[i];
+	}
+}
+
+int MV_FILE::GetIndexRow(int index) {
 	if (index == 0)
 		index = 256;
-	int row = (ROWS - 1) - (index - 1) / 8;
+	return (ROWS - 1) - (index - 1) / 8;
+}
+
+// Row names used in the error messages of FIX_PALETTE_MAPPING
+string MV_FILE::GetRowNote(int row) {
 	if (row == 0)
 		return "none";
-	return notes[row];
+	string note = notes[row];
+	if (note.find(MaterialPrefix) == 0)
+		note = note.substr(strlen(MaterialPrefix));
+	return note;
 }
 
 void MV_FILE::FIX_PALETTE_MAPPING() {
-	bool fixed[256];
-	bool occupied[256];
+	bitset<256> fixed;
+	bitset<256> occupied;
 	uint8_t reverse_map[256];
-	for (int i = 0; i < 256; i++) {
-		fixed[i] = false;
-		occupied[i] = false;
+	for (int i = 0; i < 256; i++)
 		reverse_map[i] = i;
-	}
+
+	int row_material[ROWS];
+	for (int i = 0; i < ROWS; i++)
+		row_material[i] = td_row_material[i];
 
 	// Mark materials already in the correct row
 	for (int i = 0; i < 256; i++) {
-		if (is_index_used[i] && GetIndexNote(i) == MaterialName[material[i].td_type]) {
+		if (is_index_used[i] && row_material[GetIndexRow(i)] == material[i].td_type) {
 			fixed[i] = true;
 			occupied[i] = true;
 		}
@@ -349,67 +586,63 @@ void MV_FILE::FIX_PALETTE_MAPPING() {
 	};
 
 	// Move materials to an empty space in a correct row
+	// Indices are only ever occupied, so the search for each material resumes where it stopped
+	int next_index[256] = {};
 	for (int i = 0; i < 256; i++) {
 		if (is_index_used[i] && !fixed[i]) {
-			string mat_name = MaterialName[material[i].td_type];
-			for (int j = 0; j < 256; j++) {
-				if (!occupied[j] && GetIndexNote(j) == mat_name) {
-					fixed[i] = true;
-					occupied[j] = true;
-					swap_mapping(i, j);
-					break;
-				}
+			uint8_t type = material[i].td_type;
+			int j = next_index[type];
+			while (j < 256 && (occupied[j] || row_material[GetIndexRow(j)] != type))
+				j++;
+			next_index[type] = j;
+			if (j < 256) {
+				fixed[i] = true;
+				occupied[j] = true;
+				swap_mapping(i, j);
 			}
 		}
 	}
 
 	// Move materials to a renamed empty row
+	// Rows are indexed from the start of the palette, each one only fills up once
+	uint8_t row_used[ROWS] = {};
+	for (int i = 1; i < 256; i++)
+		if (occupied[i])
+			row_used[(i - 1) / 8]++;
+	int empty_row = 0;
 	for (int i = 0; i < 256; i++) {
 		if (is_index_used[i] && !fixed[i]) {
-			string mat_name = MaterialName[material[i].td_type];
-			// Check if row is empty
-			for (int j = 0; j < ROWS; j++) {
-				bool row_empty = true;
-				for (int k = 0; k < 8; k++) {
-					int idx = 8 * j + k + 1;
-					if (idx < 256 && occupied[idx]) {
-						row_empty = false;
-						break;
-					}
-				}
-				if (row_empty) {
-					int note_idx = ROWS - 1 - j;
-					int starting_index = 8 * j + 1;
-					fixed[i] = true;
-					occupied[starting_index] = true;
-					swap_mapping(i, starting_index);
-					notes[note_idx] = MaterialPrefix + mat_name;
-
-					// Move materials of the same type to this new row
-					for (int l = 0; l < 256; l++) {
-						if (is_index_used[l] && !fixed[l] && material[l].td_type == material[i].td_type) {
-							for (int m = starting_index; m < starting_index + 8; m++) {
-								if (m < 256 && !occupied[m]) {
-									fixed[l] = true;
-									occupied[m] = true;
-									swap_mapping(l, m);
-									// Pigeon paradise!
-									// (because of the nesting, get it?)
-									break;
-								}
-							}
-						}
-					}
-					break;
+			while (empty_row < ROWS && row_used[empty_row] > 0)
+				empty_row++;
+			if (empty_row == ROWS)
+				break;
+
+			uint8_t type = material[i].td_type;
+			int note_idx = ROWS - 1 - empty_row;
+			int starting_index = 8 * empty_row + 1;
+			fixed[i] = true;
+			occupied[starting_index] = true;
+			row_used[empty_row]++;
+			swap_mapping(i, starting_index);
+			notes[note_idx] = MaterialPrefix + string(MaterialName[type]);
+			row_material[note_idx] = type;
+
+			// Move materials of the same type to this new row
+			int m = starting_index + 1;
+			for (int l = 0; l < 256 && m < starting_index + 8; l++) {
+				if (is_index_used[l] && !fixed[l] && material[l].td_type == type) {
+					fixed[l] = true;
+					occupied[m] = true;
+					row_used[empty_row]++;
+					swap_mapping(l, m);
+					m++;
 				}
 			}
 		}
 	}
 
 	// Check valid permutation
-	bool mapped[256];
-	for (int i = 0; i < 256; i++)
-		mapped[i] = false;
+	bitset<256> mapped;
 	for (int i = 0; i < 256; i++)
 		mapped[palette_map[i]] = true;
 	for (int i = 0; i < 256; i++)
@@ -420,13 +653,10 @@ void MV_FILE::FIX_PALETTE_MAPPING() {
 	for (int i = 1; i < 254; i++) { // Last two indices are correct
 		if (is_index_used[i]) {
 			int j = reverse_map[i];
-			string note = GetIndexNote(j);
-			if (note.find(MaterialPrefix) == 0)
-				note = note.substr(strlen(MaterialPrefix));
-			string mat_name = MaterialName[material[i].td_type];
-			if (note != mat_name)
+			int row = GetIndexRow(j);
+			if (row_material[row] != material[i].td_type)
 				throw logic_error("Index " + to_string(i) + " mapped to " + to_string(j) + " with incorrect row " +
-								  note + " for material " + mat_name);
+								  GetRowNote(row) + " for material " + MaterialName[material[i].td_type]);
 		}
 	}
 }
@@ -67,16 +67,54 @@ struct MV_Shape {
 	string name;
 	int pos_x, pos_y, pos_z;
 	Tensor3D voxels;
+	int handle = 0; // Entity the shape comes from
 	bool operator==(const MV_Shape& other) const;
 };
 
+// Voxel data of a model is written to disk as soon as it is added,
+// only what is needed for the scene graph and deduplication is kept
+struct MV_Model {
+	string name;
+	int pos_x, pos_y, pos_z;
+	int sizex, sizey, sizez;
+	uint64_t hash;
+	int handle;
+	long int offset; // Position of the SIZE chunk in the file
+};
+
+// Models of each file written by a previous conversion, used to skip unchanged files
+struct MV_ManifestFile {
+	bool compress;
+	uint64_t palette_hash;
+	long int data_size;
+	long int file_size;
+	uint64_t file_hash;
+	vector<MV_Model> models;
+};
+
+typedef map<string, MV_ManifestFile> MV_Manifest; // By file name
+
+void SaveManifest(string path, const MV_Manifest& manifest);
+
 class MV_FILE {
 private:
 	FILE* vox_file;
 	string filename;
 	bool write_imap;
+	bool compress;
 	long int children_size_ptr;
-	vector<MV_Shape> models;
+	long int data_size;
+	long int file_size;
+	bool header_written;
+	vector<MV_Model> models;
+
+	// Incremental conversion: nothing is written while the models added
+	// match the ones from the previous conversion, in the same order
+	const MV_ManifestFile* previous;
+	map<uint64_t, int> previous_index;
+	string write_path;
+	bool is_writing;
+	int unchanged_models;
 	static const int ROWS = 32;
 	string notes[ROWS];
 
@@ -85,9 +123,21 @@ private:
 	MV_Material material[256];
 	uint8_t palette_map[256];
 
-	string GetIndexNote(int index);
+	static int GetIndexRow(int index);
+	string GetRowNote(int row);
 	void FIX_PALETTE_MAPPING();
 
+	uint64_t GetPaletteHash() const;
+
+	// Files kept open for appending models, the least recently used is
+	// closed when there are too many
+	static const unsigned int MAX_OPEN_FILES = 16;
+	static vector<MV_FILE*> open_files;
+	bool OpenForAppend();
+	void CloseFile();
+	void StartWriting();
+	bool CopyPreviousModel(const MV_Model& previous_model);
+
 	void WriteInt(int val);
 	void WriteDICT(DICT dict);
 	void WriteFileHeader();
@@ -104,11 +154,19 @@ private:
 	void WriteMATL(uint8_t index, const MV_Material& mat);
 	void WriteNOTE();
 public:
-	MV_FILE(string filename, bool write_imap = true);
-	void SaveModel(bool compress = false);
+	MV_FILE(string filename, bool write_imap = true, bool compress = false);
+	~MV_FILE();
+	void SaveModel();
 	void AddShape(const MV_Shape& shape);
+	void AddShape(const MV_Shape& shape, uint64_t hash);
 	bool GetShapeName(const MV_Shape& shape, string& name) const;
+	bool GetShapeName(const MV_Shape& shape, uint64_t hash, string& name) const;
+	int GetModelCount() const;
+	long int GetDataSize() const;
 	void SetEntry(uint8_t index, const MV_Color& color, MV_Material mat);
+	void CopyEntries(const MV_FILE& other);
+	void SetPrevious(const MV_ManifestFile* entry);
+	MV_ManifestFile GetManifest() const;
 };
 
 const int SNOW_INDEX = 254;
@@ -1,18 +1,23 @@
 #include <math.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <algorithm>
 #include <map>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "scene.h"
 #include "entity.h"
 #include "math_utils.h"
 #include "misc_utils.h"
+#include "vox_reader.h"
 #include "vox_writer.h"
 #include "xml_writer.h"
 #include "write_scene.h"
-#include "../lib/tinyxml2.h"
 
 static MV_Color ToMV(const Color& color) {
 	uint8_t r = 255.0 * color.r;
@@ -53,37 +58,44 @@ static MV_Material ToMV(const Material& material) {
 
 static string ConcatTags(const SmallVec<Tag>& tags) {
 	string tag_str = "";
-	for (unsigned int i = 0; i < tags.getSize(); i++) {
-		tag_str += tags[i].name;
-		if (tags[i].value.length() > 0)
-			tag_str += "=" + tags[i].value;
-		if (i != tags.getSize() - 1)
+	for (SmallVec<Tag>::const_iterator it = tags.begin(); it != tags.end(); it++) {
+		if (it != tags.begin())
 			tag_str += " ";
+		tag_str += it->name;
+		if (it->value.length() > 0)
+			tag_str += "=" + it->value;
 	}
 	return tag_str;
 }
 
+thread_local XML_Writer* WriteXML::xml = nullptr;
+thread_local vector<PendingVox>* WriteXML::pending_vox = nullptr;
+
 WriteXML::WriteXML(ConverterParams params) : params(params) {
+	xml = &main_xml;
 	InitScene(params.bin_path);
-	xml.SetTransformPrecision(params.transform_precision);
+	main_xml.SetTransformPrecision(params.transform_precision);
+	if (params.incremental_vox)
+		LoadManifest(GetManifestPath(), vox_manifest);
 }
 
 WriteXML::~WriteXML() {
-	for (map<uint32_t, MV_FILE*>::iterator it = vox_files.begin(); it != vox_files.end(); it++)
-		delete it->second;
+	for (map<string, vector<MV_FILE*>>::iterator it = vox_files.begin(); it != vox_files.end(); it++)
+		for (unsigned int i = 0; i < it->second.size(); i++)
+			delete it->second[i];
 	vox_files.clear();
 }
 
 void WriteXML::WriteScene() {
 	string version_str = to_string(scene.version[0]) + "." + to_string(scene.version[1]) + "." + to_string(scene.version[2]);
-	xml.AddStringAttribute(xml.GetScene(), "version", version_str);
-	xml.AddVec3Attribute(xml.GetScene(), "shadowVolume", scene.shadow_volume, "100 25 100");
+	xml->AddStringAttribute(xml->GetScene(), "version", version_str);
+	xml->AddVec3Attribute(xml->GetScene(), "shadowVolume", scene.shadow_volume, Vec3(100, 25, 100));
 }
 
 void WriteXML::WriteSpawnpoint() {
-	XMLElement* spawnpoint = xml.AddChildElement(xml.GetScene(), "spawnpoint");
+	XML_Element* spawnpoint = xml->AddChildElement(xml->GetScene(), "spawnpoint");
 	scene.spawnpoint.rot = scene.spawnpoint.rot * QuatEuler(0, 180, 0);
-	xml.AddTransformAttribute(spawnpoint, scene.spawnpoint);
+	xml->AddTransformAttribute(spawnpoint, scene.spawnpoint);
 }
 
 void WriteXML::WriteEnvironment() {
@@ -106,43 +118,43 @@ void WriteXML::WriteEnvironment() {
 	if (fog->type == Fog::Classic)
 		fog->params.y += fog->params.x; // end = start + distance
 
-	XMLElement* environment = xml.AddChildElement(xml.GetScene(), "environment");
-	xml.AddStringAttribute(environment, "skybox", skybox_texture, "cloudy.dds");
-	xml.AddColorAttribute(environment, "skyboxtint", skybox->tint, "1 1 1");
-	xml.AddFloatAttribute(environment, "skyboxbrightness", skybox->brightness, "1");
-	xml.AddFloatAttribute(environment, "skyboxrot", deg(skybox->rot), "0");
-	xml.AddVec3Attribute(environment, "skyboxaxis", Vec3(0, 1, 0), "0 1 0");
-	xml.AddStringAttribute(environment, "lensdirt", scene.environment.lensdirt);
-	xml.AddColorAttribute(environment, "constant", skybox->constant, "0.003 0.003 0.003");
-	xml.AddFloatAttribute(environment, "ambient", skybox->ambient, "1");
-	xml.AddFloatAttribute(environment, "ambientexponent", skybox->ambientexponent, "1.3");
-	xml.AddStringAttribute(environment, "fog", FogType[fog->type], "classic");
-	xml.AddColorAttribute(environment, "fogColor", fog->color, "1 1 1");
-	xml.AddVec4Attribute(environment, "fogParams", fog->params, "40 100 0.9 4");
-	xml.AddFloatAttribute(environment, "fogHeightOffset", fog->height_offset, "0");
-	xml.AddFloatAttribute(environment, "sunBrightness", skybox->sun.brightness, "0");
-	xml.AddColorAttribute(environment, "sunColorTint", skybox->sun.colortint, "1 1 1");
+	XML_Element* environment = xml->AddChildElement(xml->GetScene(), "environment");
+	xml->AddStringAttribute(environment, "skybox", skybox_texture, "cloudy.dds");
+	xml->AddColorAttribute(environment, "skyboxtint", skybox->tint, Color{1, 1, 1, 1});
+	xml->AddFloatAttribute(environment, "skyboxbrightness", skybox->brightness, 1);
+	xml->AddFloatAttribute(environment, "skyboxrot", deg(skybox->rot), 0);
+	xml->AddVec3Attribute(environment, "skyboxaxis", Vec3(0, 1, 0), Vec3(0, 1, 0));
+	xml->AddStringAttribute(environment, "lensdirt", scene.environment.lensdirt);
+	xml->AddColorAttribute(environment, "constant", skybox->constant, Color{0.003, 0.003, 0.003, 1});
+	xml->AddFloatAttribute(environment, "ambient", skybox->ambient, 1);
+	xml->AddFloatAttribute(environment, "ambientexponent", skybox->ambientexponent, 1.3);
+	xml->AddStringAttribute(environment, "fog", FogType[fog->type], "classic");
+	xml->AddColorAttribute(environment, "fogColor", fog->color, Color{1, 1, 1, 1});
+	xml->AddVec4Attribute(environment, "fogParams", fog->params, Vec4(40, 100, 0.9, 4));
+	xml->AddFloatAttribute(environment, "fogHeightOffset", fog->height_offset, 0);
+	xml->AddFloatAttribute(environment, "sunBrightness", skybox->sun.brightness, 0);
+	xml->AddColorAttribute(environment, "sunColorTint", skybox->sun.colortint, Color{1, 1, 1, 1});
 	if (!skybox->sun.auto_dir)
-		xml.AddVec3Attribute(environment, "sunDir", skybox->sun.dir, "auto");
-	xml.AddFloatAttribute(environment, "sunSpread", skybox->sun.spread, "0");
-	xml.AddFloatAttribute(environment, "sunLength", skybox->sun.length, "32");
-	xml.AddFloatAttribute(environment, "sunFogScale", skybox->sun.fogscale, "1");
-	xml.AddFloatAttribute(environment, "sunGlare", skybox->sun.glare, "1");
-	xml.AddVec2Attribute(environment, "exposure", scene.environment.exposure, "0 10");
-	xml.AddFloatAttribute(environment, "brightness", scene.environment.brightness, "1");
-	xml.AddFloatAttribute(environment, "wetness", water->wetness, "0");
-	xml.AddFloatAttribute(environment, "puddleamount", water->puddleamount, "0");
-	xml.AddFloatAttribute(environment, "puddlesize", 0.01 / water->puddlesize, "0.5");
-	xml.AddFloatAttribute(environment, "rain", water->rain, "0");
-	xml.AddBoolAttribute(environment, "nightlight", scene.environment.nightlight, true);
-	xml.AddSoundAttribute(environment, "ambience", scene.environment.ambience, "outdoor/field.ogg");
-	xml.AddFloatAttribute(environment, "fogscale", scene.environment.fogscale, "1");
-	xml.AddFloatAttribute(environment, "slippery", scene.environment.slippery, "0");
-	xml.AddFloatAttribute(environment, "waterhurt", scene.environment.waterhurt, "0");
-	xml.AddVec4Attribute(environment, "snowdir", snow->dir, "0 -1 0 0.2");
-	xml.AddVec2Attribute(environment, "snowamount", snow->amount, "0 0");
-	xml.AddBoolAttribute(environment, "snowonground", snow->onground && !params.remove_snow, false);
-	xml.AddVec3Attribute(environment, "wind", scene.environment.wind, "0 0 0");
+		xml->AddVec3Attribute(environment, "sunDir", skybox->sun.dir);
+	xml->AddFloatAttribute(environment, "sunSpread", skybox->sun.spread, 0);
+	xml->AddFloatAttribute(environment, "sunLength", skybox->sun.length, 32);
+	xml->AddFloatAttribute(environment, "sunFogScale", skybox->sun.fogscale, 1);
+	xml->AddFloatAttribute(environment, "sunGlare", skybox->sun.glare, 1);
+	xml->AddVec2Attribute(environment, "exposure", scene.environment.exposure, Vec2(0, 10));
+	xml->AddFloatAttribute(environment, "brightness", scene.environment.brightness, 1);
+	xml->AddFloatAttribute(environment, "wetness", water->wetness, 0);
+	xml->AddFloatAttribute(environment, "puddleamount", water->puddleamount, 0);
+	xml->AddFloatAttribute(environment, "puddlesize", 0.01 / water->puddlesize, 0.5);
+	xml->AddFloatAttribute(environment, "rain", water->rain, 0);
+	xml->AddBoolAttribute(environment, "nightlight", scene.environment.nightlight, true);
+	xml->AddSoundAttribute(environment, "ambience", scene.environment.ambience, "outdoor/field.ogg");
+	xml->AddFloatAttribute(environment, "fogscale", scene.environment.fogscale, 1);
+	xml->AddFloatAttribute(environment, "slippery", scene.environment.slippery, 0);
+	xml->AddFloatAttribute(environment, "waterhurt", scene.environment.waterhurt, 0);
+	xml->AddVec4Attribute(environment, "snowdir", snow->dir, Vec4(0, -1, 0, 0.2));
+	xml->AddVec2Attribute(environment, "snowamount", snow->amount, Vec2(0, 0));
+	xml->AddBoolAttribute(environment, "snowonground", snow->onground && !params.remove_snow, false);
+	xml->AddVec3Attribute(environment, "wind", scene.environment.wind, Vec3(0, 0, 0));
 
 	params.remove_snow = params.remove_snow && snow->onground; // Only remove snow if there is snow to remove
 }
@@ -152,128 +164,663 @@ void WriteXML::WriteBoundary() {
 	if (vertex_count == 0)
 		return;
 
-	XMLElement* boundary = xml.AddChildElement(xml.GetScene(), "boundary");
-	xml.AddFloatAttribute(boundary, "padleft", -scene.boundary.padleft, "5");
-	xml.AddFloatAttribute(boundary, "padright", scene.boundary.padright, "5");
-	xml.AddFloatAttribute(boundary, "padtop", -scene.boundary.padtop, "5");
-	xml.AddFloatAttribute(boundary, "padbottom", scene.boundary.padbottom, "5");
-	xml.AddFloatAttribute(boundary, "maxheight", scene.boundary.maxheight, "0");
-	xml.AddVerticesAttribute(boundary, scene.boundary.vertices);
+	XML_Element* boundary = xml->AddChildElement(xml->GetScene(), "boundary");
+	xml->AddFloatAttribute(boundary, "padleft", -scene.boundary.padleft, 5);
+	xml->AddFloatAttribute(boundary, "padright", scene.boundary.padright, 5);
+	xml->AddFloatAttribute(boundary, "padtop", -scene.boundary.padtop, 5);
+	xml->AddFloatAttribute(boundary, "padbottom", scene.boundary.padbottom, 5);
+	xml->AddFloatAttribute(boundary, "maxheight", scene.boundary.maxheight, 0);
+	xml->AddVerticesAttribute(boundary, scene.boundary.vertices);
 }
 
 void WriteXML::WritePostProcessing() {
-	XMLElement* postprocessing = xml.AddChildElement(xml.GetScene(), "postprocessing");
-	xml.AddFloatAttribute(postprocessing, "saturation", scene.postpro.saturation, "1");
-	xml.AddColorAttribute(postprocessing, "colorbalance", scene.postpro.colorbalance, "1 1 1");
-	xml.AddFloatAttribute(postprocessing, "brightness", scene.postpro.brightness, "1");
-	xml.AddFloatAttribute(postprocessing, "gamma", scene.postpro.gamma, "1");
-	xml.AddFloatAttribute(postprocessing, "bloom", scene.postpro.bloom, "1");
+	XML_Element* postprocessing = xml->AddChildElement(xml->GetScene(), "postprocessing");
+	xml->AddFloatAttribute(postprocessing, "saturation", scene.postpro.saturation, 1);
+	xml->AddColorAttribute(postprocessing, "colorbalance", scene.postpro.colorbalance, Color{1, 1, 1, 1});
+	xml->AddFloatAttribute(postprocessing, "brightness", scene.postpro.brightness, 1);
+	xml->AddFloatAttribute(postprocessing, "gamma", scene.postpro.gamma, 1);
+	xml->AddFloatAttribute(postprocessing, "bloom", scene.postpro.bloom, 1);
+}
+
+static bool ContainsScript(const XML_Element* element) {
+	for (const XML_Element* child = element->FirstChild(); child != nullptr; child = child->NextSibling())
+		if (child->Name() == string("script") || ContainsScript(child))
+			return true;
+	return false;
+}
+
+// Bodies and vehicles that only differ in their transform are saved once
+// as a prefab. Identical shapes already share the same .vox model, so
+// comparing the XML text also compares the voxels.
+void WriteXML::WritePrefabs() {
+	if (!params.use_prefabs)
+		return;
+
+	vector<string> keys; // In order of first appearance
+	unordered_map<string, vector<XML_Element*>> subtrees;
+	GroupType group_types[] = { STATIC, PROP, VEHICLE };
+	for (unsigned int i = 0; i < sizeof(group_types) / sizeof(group_types[0]); i++) {
+		XML_Element* group = main_xml.GetGroupElement(group_types[i]);
+		for (XML_Element* child = group->FirstChild(); child != nullptr; child = child->NextSibling()) {
+			if (child->Name() != string("body") && child->Name() != string("vehicle"))
+				continue;
+			// Scripts refer to entities of the level, they cannot be repeated
+			if (child->NoChildren() || ContainsScript(child))
+				continue;
+			string key = main_xml.GetSubtreeKey(child);
+			vector<XML_Element*>& elements = subtrees[key];
+			if (elements.empty())
+				keys.push_back(key);
+			elements.push_back(child);
+		}
+	}
+
+	string prefab_folder = params.legacy_format ? "custom/" : "prefab/";
+	string path_prefix = params.legacy_format ? "LEVEL/" : "MOD/prefab/";
+	string version_str = to_string(scene.version[0]) + "." + to_string(scene.version[1]) + "." + to_string(scene.version[2]);
+	int prefab_count = 0;
+	for (unsigned int i = 0; i < keys.size(); i++) {
+		vector<XML_Element*>& elements = subtrees[keys[i]];
+		if (elements.size() < 2)
+			continue;
+		string name = "prefab" + to_string(prefab_count++) + ".xml";
+		for (unsigned int j = 0; j < elements.size(); j++)
+			main_xml.ReplaceWithInstance(elements[j], path_prefix + name);
+		main_xml.SavePrefab(elements[0], version_str, (params.map_folder + prefab_folder + name).c_str());
+	}
 }
 
 void WriteXML::SaveXML() {
 	string main_xml_path = params.map_folder + (params.legacy_format ? "custom.xml" : "main.xml");
-	xml.SaveFile(main_xml_path.c_str());
+	main_xml.SaveFile(main_xml_path.c_str());
 }
 
 void WriteXML::SaveVoxFiles() {
-	for (map<uint32_t, MV_FILE*>::iterator it = vox_files.begin(); it != vox_files.end(); it++)
-		it->second->SaveModel(params.compress_vox);
+	for (map<string, vector<MV_FILE*>>::iterator it = vox_files.begin(); it != vox_files.end(); it++)
+		for (unsigned int i = 0; i < it->second.size(); i++)
+			it->second[i]->SaveModel();
+
+	if (!params.incremental_vox)
+		return;
+
+	// Record the models of each file so the next conversion can skip unchanged ones
+	MV_Manifest manifest;
+	for (map<string, vector<MV_FILE*>>::iterator it = vox_files.begin(); it != vox_files.end(); it++)
+		for (unsigned int i = 0; i < it->second.size(); i++)
+			manifest[GetVoxShardName(it->first, i) + ".vox"] = it->second[i]->GetManifest();
+	SaveManifest(GetManifestPath(), manifest);
+
+	// Remove files of the previous conversion that are no longer used
+	string vox_folder = params.map_folder + (params.legacy_format ? "custom/" : "vox/");
+	for (MV_Manifest::iterator it = vox_manifest.begin(); it != vox_manifest.end(); it++)
+		if (manifest.find(it->first) == manifest.end())
+			remove((vox_folder + it->first).c_str());
+}
+
+string WriteXML::GetManifestPath() {
+	return params.map_folder + (params.legacy_format ? "custom/" : "vox/") + "manifest.txt";
+}
+
+static unsigned int CountEntities(const Entity* entity) {
+	unsigned int count = 1;
+	for (unsigned int i = 0; i < entity->children.getSize(); i++)
+		count += CountEntities(entity->children[i]);
+	return count;
 }
 
 void WriteXML::WriteEntities() {
-	xml.CreateGroups();
+	xml->CreateGroups();
 
+	unsigned int entity_count = 0;
+	for (unsigned int i = 0; i < scene.entities.getSize(); i++)
+		entity_count += CountEntities(scene.entities[i]);
+	contexts.clear();
+	contexts.reserve(entity_count); // Mapped by pointer
 	for (unsigned int i = 0; i < scene.entities.getSize(); i++)
-		WriteEntity(xml.GetScene(), scene.entities[i]);
+		BuildContexts(scene.entities[i], nullptr, Transform());
+	MarkReferencedShapes();
+
+	unsigned int thread_count = params.threads > 1 ? params.threads : 1;
+	if (thread_count > scene.entities.getSize())
+		thread_count = scene.entities.getSize();
+	if (thread_count > 1)
+		WriteEntitiesParallel(thread_count);
+	else
+		for (unsigned int i = 0; i < scene.entities.getSize(); i++)
+			WriteEntity(xml->GetScene(), scene.entities[i]);
 
 	for (unsigned int i = 0; i < scene.entities.getSize(); i++)
 		WriteEntity2ndPass(scene.entities[i]);
 
 	for (unsigned int i = 0; i < scene.players.getSize(); i++) {
 		uint32_t vehicle_handle = scene.players[i].driven_vehicle;
-		XMLElement* vehicle_xml = xml.GetEntityElement(vehicle_handle);
+		XML_Element* vehicle_xml = xml->GetEntityElement(vehicle_handle);
 		if (vehicle_xml != nullptr)
-			xml.AddBoolAttribute(vehicle_xml, "driven", true, false);
+			xml->AddBoolAttribute(vehicle_xml, "driven", true, false);
+	}
+}
+
+struct EntityWorkerData {
+	WriteXML* parser;
+	XML_Writer* writer;
+};
+
+// Writes top-level entities into the writer of the thread until none are left
+void* WriteXML::EntityWorker(void* data) {
+	EntityWorkerData* worker = static_cast<EntityWorkerData*>(data);
+	WriteXML* parser = worker->parser;
+	XML_Writer* previous_xml = xml;
+	vector<PendingVox>* previous_pending_vox = pending_vox;
+	xml = worker->writer;
+
+	unsigned int task_index;
+	while ((task_index = parser->next_task++) < parser->entity_tasks.size()) {
+		EntityTask& task = parser->entity_tasks[task_index];
+		task.writer = worker->writer;
+		pending_vox = &task.vox;
+		task.start = xml->GetMark();
+		parser->WriteEntity(xml->GetScene(), task.entity);
+		task.end = xml->GetMark();
+	}
+
+	xml = previous_xml;
+	pending_vox = previous_pending_vox;
+	return nullptr;
+}
+
+// Each top-level entity is written by a worker into its own tree. The subtrees
+// are then moved into the groups, and the .vox models added, in the original
+// order, so the output is the same as writing everything on a single thread.
+void WriteXML::WriteEntitiesParallel(unsigned int thread_count) {
+	entity_tasks.clear();
+	entity_tasks.resize(scene.entities.getSize());
+	for (unsigned int i = 0; i < scene.entities.getSize(); i++)
+		entity_tasks[i].entity = scene.entities[i];
+	next_task = 0;
+
+	vector<EntityWorkerData> workers(thread_count);
+	for (unsigned int i = 0; i < thread_count; i++) {
+		workers[i].parser = this;
+		workers[i].writer = new XML_Writer();
+		workers[i].writer->SetTransformPrecision(params.transform_precision);
+		workers[i].writer->CreateGroups();
+	}
+
+	// The calling thread is also a worker
+	vector<pthread_t> threads;
+	for (unsigned int i = 1; i < thread_count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, nullptr, EntityWorker, &workers[i]) == 0)
+			threads.push_back(thread);
+		else
+			printf("[WARNING] Could not create worker thread\n");
+	}
+	EntityWorker(&workers[0]);
+	for (unsigned int i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], nullptr);
+
+	for (unsigned int i = 0; i < entity_tasks.size(); i++) {
+		EntityTask& task = entity_tasks[i];
+		main_xml.MoveChildren(*task.writer, task.start, task.end);
+		for (unsigned int j = 0; j < task.vox.size(); j++)
+			WritePendingVox(task.vox[j]);
+	}
+	entity_tasks.clear();
+
+	for (unsigned int i = 0; i < thread_count; i++) {
+		main_xml.Merge(*workers[i].writer);
+		delete workers[i].writer;
 	}
 }
 
-static Transform GetEntityTransform(const Entity* entity) {
+Transform WriteXML::GetEntityTransform(const Entity* entity) {
 	if (entity == nullptr)
 		return Transform();
 	switch (entity->type) {
 	case Entity::Body: {
-		Body* body = static_cast<Body*>(entity->self);
+		Body* body = &scene.bodies[entity->index];
 		return body->transform;
 	}
 	case Entity::Shape: {
-		Shape* shape = static_cast<Shape*>(entity->self);
+		Shape* shape = &scene.shapes[entity->index];
 		return shape->transform;
 	}
 	case Entity::Light: {
-		Light* light = static_cast<Light*>(entity->self);
+		Light* light = &scene.lights[entity->index];
 		return light->transform;
 	}
 	case Entity::Location: {
-		Location* location = static_cast<Location*>(entity->self);
+		Location* location = &scene.locations[entity->index];
 		return location->transform;
 	}
 	case Entity::Water: {
-		Water* water = static_cast<Water*>(entity->self);
+		Water* water = &scene.waters[entity->index];
 		return water->transform;
 	}
 	case Entity::Vehicle: {
-		Vehicle* vehicle = static_cast<Vehicle*>(entity->self);
+		Vehicle* vehicle = &scene.vehicles[entity->index];
 		return vehicle->transform;
 	}
 	case Entity::Wheel: {
-		Wheel* wheel = static_cast<Wheel*>(entity->self);
+		Wheel* wheel = &scene.wheels[entity->index];
 		return wheel->transform;
 	}
 	case Entity::Screen: {
-		Screen* screen = static_cast<Screen*>(entity->self);
+		Screen* screen = &scene.screens[entity->index];
 		return screen->transform;
 	}
 	case Entity::Trigger: {
-		Trigger* trigger = static_cast<Trigger*>(entity->self);
+		Trigger* trigger = &scene.triggers[entity->index];
 		return trigger->transform;
 	}
 	case Entity::Animator: {
-		Animator* animator = static_cast<Animator*>(entity->self);
+		Animator* animator = &scene.animators[entity->index];
 		return animator->transform;
 	}
+	case Entity::Rig: {
+		Rig* rig = &scene.rigs[entity->index];
+		return rig->transform;
+	}
 	default:
 		return Transform();
 	}
 }
 
-static Transform GetLocalTransform(const Entity* parent, Transform tr) {
-	Transform parent_tr = GetEntityTransform(parent);
-	return TransformToLocalTransform(parent_tr, tr);
+// The frame is the space the stored transform is relative to. Shapes are
+// relative to their body and rigs to the parent of their body, other entities
+// are in the same space as their parent.
+void WriteXML::BuildContexts(const Entity* entity, const EntityContext* parent, const Transform& frame) {
+	EntityContext context;
+	context.transform = GetEntityTransform(entity);
+	context.world = TransformToWorldTransform(frame, context.transform);
+	context.inside_vehicle = parent != nullptr &&
+		(parent->inside_vehicle || entity->parent->type == Entity::Vehicle);
+	context.inside_animator = parent != nullptr &&
+		(parent->inside_animator || entity->parent->type == Entity::Animator);
+	context.referenced = false;
+	context.merged = false;
+	contexts.push_back(context);
+	EntityContext* entity_context = &contexts.back();
+	context_mapping.Set(entity->handle, entity_context);
+
+	for (unsigned int i = 0; i < entity->children.getSize(); i++) {
+		const Entity* child = entity->children[i];
+		Transform child_frame = frame;
+		if (entity->type == Entity::Body && child->type == Entity::Shape)
+			child_frame = entity_context->world;
+		else if (entity->type == Entity::Body && child->type == Entity::Rig && parent != nullptr)
+			child_frame = parent->world;
+		BuildContexts(child, entity_context, child_frame);
+	}
 }
 
-void WriteXML::WriteBody(XMLElement* element, const Body* body, const Entity* parent) {
+// Shapes whose handle is used elsewhere keep their own element
+void WriteXML::MarkReferencedShapes() {
+	for (unsigned int i = 0; i < scene.joints.getSize(); i++)
+		for (int j = 0; j < 2; j++) {
+			EntityContext* context = context_mapping.Get(scene.joints[i].shapes[j]);
+			if (context != nullptr)
+				context->referenced = true;
+		}
+	for (unsigned int i = 0; i < scene.scripts.getSize(); i++) {
+		const Vec<uint32_t>& script_entities = scene.scripts[i].client_core.entities;
+		for (Vec<uint32_t>::const_iterator it = script_entities.begin(); it != script_entities.end(); it++) {
+			EntityContext* context = context_mapping.Get(*it);
+			if (context != nullptr)
+				context->referenced = true;
+		}
+	}
+}
+
+Transform WriteXML::GetParentTransform(const Entity* parent) {
+	if (parent == nullptr)
+		return Transform();
+	return context_mapping.Get(parent->handle)->transform;
+}
+
+Transform WriteXML::GetLocalTransform(const Entity* parent, const Transform& tr) {
+	return TransformToLocalTransform(GetParentTransform(parent), tr);
+}
+
+// Shapes using the same palette share a file, optionally split by world position
+string WriteXML::GetVoxGroup(const Shape* shape, int handle) {
+	string group = "palette" + to_string(palette_mapping[shape->voxels.palette_id]);
+	if (params.vox_cell_size > 0) {
+		Vec3 pos = shape->original_tr.pos;
+		const Entity* parent = entity_mapping.Get(handle)->parent;
+		if (parent != nullptr && parent->type == Entity::Body)
+			pos = TransformToWorldTransform(context_mapping.Get(parent->handle)->world, shape->original_tr).pos;
+		int cell_x = floor(pos.x / params.vox_cell_size);
+		int cell_z = floor(pos.z / params.vox_cell_size);
+		group += "_x" + to_string(cell_x) + "_z" + to_string(cell_z);
+	}
+	return group;
+}
+
+string WriteXML::GetVoxShardName(const string& group, int shard) {
+	if (shard == 0)
+		return group;
+	return group + "_" + to_string(shard);
+}
+
+MV_FILE* WriteXML::CreateVoxFile(const string& name) {
+	string vox_folder = params.legacy_format ? "custom/" : "vox/";
+	string vox_full_path = params.map_folder + vox_folder + name + ".vox";
+	MV_FILE* vox_file = new MV_FILE(vox_full_path, true, params.compress_vox);
+	MV_Manifest::const_iterator previous = vox_manifest.find(name + ".vox");
+	if (previous != vox_manifest.end())
+		vox_file->SetPrevious(&previous->second);
+	return vox_file;
+}
+
+// Returns the shard where new models of the group are added
+MV_FILE* WriteXML::GetVoxFile(const string& group) {
+	vector<MV_FILE*>& shards = vox_files[group];
+	if (shards.empty())
+		shards.push_back(CreateVoxFile(group));
+	return shards.back();
+}
+
+// Adds the shape to the group unless it is a duplicate, in which case vox_object is
+// replaced with the name of the existing model. Returns the path of the file used.
+string WriteXML::AddVoxShape(const string& group, const MV_Shape& mvshape, uint64_t hash, string& vox_object) {
+	vector<MV_FILE*>& shards = vox_files[group];
+	int shard = 0;
+	bool duplicated = false;
+	while (shard < (int)shards.size() && !duplicated) {
+		duplicated = shards[shard]->GetShapeName(mvshape, hash, vox_object);
+		if (!duplicated)
+			shard++;
+	}
+
+	if (!duplicated) {
+		shard = shards.size() - 1;
+		MV_FILE* vox_file = shards[shard];
+		bool is_full = vox_file->GetModelCount() > 0 &&
+			((params.vox_max_models > 0 && vox_file->GetModelCount() >= params.vox_max_models) ||
+			 (params.vox_max_bytes > 0 && vox_file->GetDataSize() >= params.vox_max_bytes));
+		if (is_full) {
+			shard++;
+			MV_FILE* next_file = CreateVoxFile(GetVoxShardName(group, shard));
+			next_file->CopyEntries(*vox_file);
+			shards.push_back(next_file);
+			vox_file = next_file;
+		}
+		vox_file->AddShape(mvshape, hash);
+	}
+
+	string path_prefix = params.legacy_format ? "LEVEL/" : "MOD/vox/";
+	return path_prefix + GetVoxShardName(group, shard) + ".vox";
+}
+
+// Worker threads keep the model for later, the main thread adds it right away
+void WriteXML::AddPendingVox(PendingVox& vox) {
+	if (pending_vox != nullptr)
+		pending_vox->push_back(move(vox));
+	else
+		WritePendingVox(vox);
+}
+
+void WriteXML::WritePendingVox(PendingVox& vox) {
+	MV_FILE* vox_file = GetVoxFile(vox.group);
+	if (vox.add_hole)
+		vox_file->SetEntry(255, HOLE_COLOR, HOLE_MATERIAL);
+	// Entries keep the first value set, so the order of the indices does not matter
+	const Palette& palette = scene.palettes[vox.palette_id];
+	for (unsigned int index = 1; index < 256; index++)
+		if (vox.used[index]) {
+			const Material& palette_entry = palette.materials[index];
+			vox_file->SetEntry(index, ToMV(palette_entry.rgba), ToMV(palette_entry));
+		}
+	if (vox.element == nullptr)
+		return;
+
+	string vox_object = vox.mvshape.name;
+	string vox_path = AddVoxShape(vox.group, vox.mvshape, vox.hash, vox_object);
+	xml->AddStringAttribute(vox.element, "file", vox_path);
+	xml->AddStringAttribute(vox.element, "object", vox_object);
+}
+
+void WriteXML::WriteBody(XML_Element* element, const Body* body, const Entity* parent) {
 	element->SetName("body");
-	xml.AddTransformAttribute(element, GetLocalTransform(parent, body->transform));
-	xml.AddBoolAttribute(element, "dynamic", body->dynamic, false);
-	if (element->Parent() == xml.GetScene() && body->dynamic)
-		xml.GetGroupElement(PROP)->InsertEndChild(element);
+	xml->AddTransformAttribute(element, GetLocalTransform(parent, body->transform));
+	xml->AddBoolAttribute(element, "dynamic", body->dynamic, false);
+	if (element->Parent() == xml->GetScene() && body->dynamic)
+		xml->GetGroupElement(PROP)->InsertEndChild(element);
+}
+
+// Shape of a static body that may be merged into a sibling
+struct MergeCandidate {
+	const Entity* entity;
+	Shape* shape;
+	int min[3], max[3];	// Bounds of the voxels
+	int offset[3];		// Position in voxels relative to the first shape of its group
+	bool merged;
+};
+
+// Shapes written with the same attributes
+static bool SameShapeMaterial(const Shape* a, const Shape* b) {
+	return a->texture.tile == b->texture.tile && a->texture.weight == b->texture.weight &&
+		   a->blendtexture.tile == b->blendtexture.tile && a->blendtexture.weight == b->blendtexture.weight &&
+		   a->density == b->density && a->strength == b->strength && a->shape_flags == b->shape_flags;
+}
+
+// Position of shape b in voxels of shape a, if both grids are aligned
+static bool GetVoxelOffset(const Shape* a, const Shape* b, int offset[3]) {
+	Transform local_tr = TransformToLocalTransform(a->transform, b->transform);
+	if (fabs(local_tr.rot.w) < 0.9999f) // q and -q are the same rotation
+		return false;
+	// The far side of b along each axis must stay on the grid too, a small
+	// rotation moves the voxels of long shapes by more than the tolerance
+	const int size[3] = { (int)b->voxels.sizex, (int)b->voxels.sizey, (int)b->voxels.sizez };
+	for (int axis = 0; axis < 3; axis++) {
+		Vec3 edge(axis == 0 ? size[0] : 0, axis == 1 ? size[1] : 0, axis == 2 ? size[2] : 0);
+		Vec3 error = local_tr.rot * edge - edge;
+		if (fabs(error.x) > 0.01f || fabs(error.y) > 0.01f || fabs(error.z) > 0.01f)
+			return false;
+	}
+	const float pos[3] = { local_tr.pos.x / 0.1f, local_tr.pos.y / 0.1f, local_tr.pos.z / 0.1f };
+	for (int axis = 0; axis < 3; axis++) {
+		float rounded = round(pos[axis]);
+		if (fabs(pos[axis] - rounded) > 0.01f)
+			return false;
+		offset[axis] = rounded;
+	}
+	return true;
+}
+
+// Static shapes of the body with the same palette and material that are
+// aligned to the same grid are merged into the first one of each group, as
+// long as they do not overlap and the merged model fits in the volume budget
+void WriteXML::MergeStaticShapes(const Entity* body) {
+	vector<MergeCandidate> candidates;
+	for (unsigned int i = 0; i < body->children.getSize(); i++) {
+		const Entity* child = body->children[i];
+		// Tagged shapes are gameplay objects, each one has to stay on its own
+		if (child->type != Entity::Shape || child->children.getSize() > 0 || child->tags.getSize() > 0 ||
+			context_mapping.Get(child->handle)->referenced)
+			continue;
+		MergeCandidate candidate;
+		candidate.entity = child;
+		candidate.shape = &scene.shapes[child->index];
+		candidate.merged = false;
+		if (!FloatEquals(candidate.shape->voxels.scale, 0.1f) || !candidate.shape->decoded_voxels.GetBounds(candidate.min, candidate.max))
+			continue;
+		int volume = (candidate.max[0] - candidate.min[0]) * (candidate.max[1] - candidate.min[1]) * (candidate.max[2] - candidate.min[2]);
+		if (volume < params.merge_shape_volume)
+			candidates.push_back(candidate);
+	}
+
+	for (unsigned int i = 0; i < candidates.size(); i++) {
+		MergeCandidate& first = candidates[i];
+		if (first.merged)
+			continue;
+		int group_min[3], group_max[3];
+		for (int axis = 0; axis < 3; axis++) {
+			first.offset[axis] = 0;
+			group_min[axis] = first.min[axis];
+			group_max[axis] = first.max[axis];
+		}
+		vector<MergeCandidate*> group;
+		group.push_back(&first);
+
+		for (unsigned int j = i + 1; j < candidates.size(); j++) {
+			MergeCandidate& other = candidates[j];
+			if (other.merged ||
+				palette_mapping[other.shape->voxels.palette_id] != palette_mapping[first.shape->voxels.palette_id] ||
+				!SameShapeMaterial(first.shape, other.shape) ||
+				other.entity->desc != first.entity->desc ||
+				!GetVoxelOffset(first.shape, other.shape, other.offset))
+				continue;
+
+			int other_min[3], other_max[3], merged_min[3], merged_max[3];
+			int64_t merged_volume = 1;
+			for (int axis = 0; axis < 3; axis++) {
+				other_min[axis] = other.offset[axis] + other.min[axis];
+				other_max[axis] = other.offset[axis] + other.max[axis];
+				merged_min[axis] = min(group_min[axis], other_min[axis]);
+				merged_max[axis] = max(group_max[axis], other_max[axis]);
+				merged_volume *= merged_max[axis] - merged_min[axis];
+			}
+			if (merged_volume > params.merge_shape_volume)
+				continue;
+
+			bool overlaps = false;
+			for (unsigned int k = 0; k < group.size() && !overlaps; k++) {
+				overlaps = true;
+				for (int axis = 0; axis < 3; axis++) {
+					int member_min = group[k]->offset[axis] + group[k]->min[axis];
+					int member_max = group[k]->offset[axis] + group[k]->max[axis];
+					if (other_min[axis] >= member_max || member_min >= other_max[axis])
+						overlaps = false;
+				}
+			}
+			if (overlaps)
+				continue;
+
+			for (int axis = 0; axis < 3; axis++) {
+				group_min[axis] = merged_min[axis];
+				group_max[axis] = merged_max[axis];
+			}
+			other.merged = true;
+			group.push_back(&other);
+		}
+		if (group.size() == 1)
+			continue;
+
+		Tensor3D merged_voxels(group_max[0] - group_min[0], group_max[1] - group_min[1], group_max[2] - group_min[2]);
+		for (unsigned int k = 0; k < group.size(); k++) {
+			const MergeCandidate* member = group[k];
+			const Tensor3D& voxels = member->shape->decoded_voxels;
+			for (int z = member->min[2]; z < member->max[2]; z++)
+				for (int y = member->min[1]; y < member->max[1]; y++)
+					for (int x = member->min[0]; x < member->max[0]; x++) {
+						uint8_t index = voxels.Get(x, y, z);
+						if (index != 0)
+							merged_voxels.Set(member->offset[0] + x - group_min[0],
+											  member->offset[1] + y - group_min[1],
+											  member->offset[2] + z - group_min[2], index);
+					}
+			if (k > 0)
+				context_mapping.Get(member->entity->handle)->merged = true;
+		}
+
+		Shape* shape = first.shape;
+		shape->decoded_voxels = merged_voxels;
+		shape->voxels.sizex = merged_voxels.sizex;
+		shape->voxels.sizey = merged_voxels.sizey;
+		shape->voxels.sizez = merged_voxels.sizez;
+		Vec3 offset = Vec3(group_min[0], group_min[1], group_min[2]) * shape->voxels.scale;
+		shape->transform.pos = shape->transform.pos + shape->transform.rot * offset;
+		shape->voxels.is_disconnected = false; // Not split again into the merged shapes
+	}
 }
 
-void WriteXML::WriteShape(XMLElement* element, Shape* shape, int handle) {
+// Crops the air around the voxels, the shape is moved so they stay in place
+static void TrimShape(Shape* shape) {
+	int min[3], max[3];
+	if (!shape->decoded_voxels.GetBounds(min, max))
+		return;
+	Voxels& voxels = shape->voxels;
+	if (min[0] == 0 && min[1] == 0 && min[2] == 0 &&
+		max[0] == (int)voxels.sizex && max[1] == (int)voxels.sizey && max[2] == (int)voxels.sizez)
+		return;
+	shape->decoded_voxels = shape->decoded_voxels.Crop(min[0], min[1], min[2], max[0] - min[0], max[1] - min[1], max[2] - min[2]);
+	voxels.sizex = max[0] - min[0];
+	voxels.sizey = max[1] - min[1];
+	voxels.sizez = max[2] - min[2];
+	Vec3 offset = Vec3(min[0], min[1], min[2]) * voxels.scale;
+	shape->transform.pos = shape->transform.pos + shape->transform.rot * offset;
+}
+
+void WriteXML::WriteShape(XML_Element* element, Shape* shape, int handle, const string& name, vector<XML_Element*>& voxboxes) {
+	shape->original_tr = shape->transform;
+	if (!params.keep_shape_extents)
+		TrimShape(shape);
 	int sizex = shape->voxels.sizex;
 	int sizey = shape->voxels.sizey;
 	int sizez = shape->voxels.sizez;
-	shape->original_tr = shape->transform;
 	bool is_scaled = !FloatEquals(shape->voxels.scale, 0.1f);
-	if (params.use_voxbox && !is_scaled && shape->decoded_voxels.IsFilledSingleColor())
-		WriteVoxbox(element, shape);
-	else if (sizex <= 256 && sizey <= 256 && sizez <= 256)
-		WriteVox(element, shape, handle);
-	else
-		WriteCompound(element, shape, handle);
+	// The extra voxboxes are siblings of the shape, so they would be left out
+	// of joints, scripts and children, and tagged objects would be repeated
+	const Entity* entity = entity_mapping.Get(handle);
+	bool allow_boxes = !context_mapping.Get(handle)->referenced && entity->children.getSize() == 0 && entity->tags.getSize() == 0;
+	ShapeEncoding encoding = ChooseShapeEncoding(shape->decoded_voxels, params.use_voxbox && !is_scaled, allow_boxes,
+												 params.remove_snow ? SNOW_INDEX : -1);
+	switch (encoding.type) {
+	case ShapeEncoding::Voxbox: {
+		VoxelBox box = { 0, 0, 0, sizex, sizey, sizez, shape->decoded_voxels.Get(0, 0, 0) };
+		WriteVoxbox(element, shape, box);
+	}
+		break;
+	case ShapeEncoding::Vox:
+		WriteVox(element, shape, handle, name);
+		break;
+	case ShapeEncoding::Compound:
+		WriteCompound(element, shape, handle, name);
+		break;
+	case ShapeEncoding::Boxes:
+		WriteVoxboxes(element, shape, handle, name, encoding, voxboxes);
+		break;
+	}
+}
+
+// Each group of connected voxels of a shape flagged as disconnected is written
+// as a shape of its own. The entity keeps the element of the first group.
+void WriteXML::WriteShapeComponents(XML_Element* element, Shape* shape, int handle, const string& name, vector<XML_Element*>& voxboxes) {
+	vector<Tensor3D> components;
+	vector<VoxelBox> bounds;
+	SplitComponents(shape->decoded_voxels, components, bounds);
+	if (components.empty()) {
+		WriteShape(element, shape, handle, name, voxboxes);
+		return;
+	}
+
+	const string& desc = entity_mapping.Get(handle)->desc;
+	Transform shape_transform = shape->transform;
+	for (unsigned int i = 0; i < components.size(); i++) {
+		XML_Element* component_element = element;
+		string component_name = name;
+		if (i > 0) {
+			component_element = xml->CreateDetachedElement("vox");
+			xml->AddStringAttribute(component_element, "desc", desc);
+			voxboxes.push_back(component_element);
+			component_name += "_" + to_string(i);
+		}
+
+		const VoxelBox& box = bounds[i];
+		shape->decoded_voxels = components[i];
+		shape->voxels.sizex = box.sizex;
+		shape->voxels.sizey = box.sizey;
+		shape->voxels.sizez = box.sizez;
+		Vec3 offset = Vec3(box.x, box.y, box.z) * shape->voxels.scale;
+		shape->transform = shape_transform;
+		shape->transform.pos = shape_transform.pos + shape_transform.rot * offset;
+		WriteShape(component_element, shape, handle, component_name, voxboxes);
+	}
 }
 
-void WriteXML::WriteVox(XMLElement* element, Shape* shape, int handle) {
+void WriteXML::WriteVox(XML_Element* element, Shape* shape, int handle, const string& name) {
 	int sizex = shape->voxels.sizex;
 	int sizey = shape->voxels.sizey;
 	int sizez = shape->voxels.sizez;
@@ -285,21 +832,13 @@ void WriteXML::WriteVox(XMLElement* element, Shape* shape, int handle) {
 	shape_transform.rot = shape_transform.rot * QuatEuler(90, 0, 0);
 	shape->transform = shape_transform;
 
-	string vox_folder = params.legacy_format ? "custom/" : "vox/";
-	string vox_filename ="palette" + to_string(shape->voxels.palette_id) + ".vox";
-	string vox_full_path = params.map_folder + vox_folder + vox_filename;
-	string path_prefix = params.legacy_format ? "LEVEL/" : "MOD/vox/";
-	string vox_path = path_prefix + vox_filename;
-	string vox_object = "shape" + to_string(handle);
-
-	MV_FILE* vox_file;
-	if (vox_files.find(shape->voxels.palette_id) == vox_files.end()) {
-		vox_file = new MV_FILE(vox_full_path);
-		vox_files[shape->voxels.palette_id] = vox_file;
-	} else
-		vox_file = vox_files[shape->voxels.palette_id];
-
-	MV_Shape mvshape = { vox_object, 0, 0, sizez / 2, shape->decoded_voxels };
+	PendingVox vox;
+	vox.group = GetVoxGroup(shape, handle);
+	vox.mvshape = { name, 0, 0, sizez / 2, shape->decoded_voxels };
+	vox.mvshape.handle = handle;
+	vox.add_hole = false;
+	vox.palette_id = shape->voxels.palette_id;
+	MV_Shape& mvshape = vox.mvshape;
 	// Add voxels in opposite corners to prevent shape from changing size when removing snow
 	// Only if those are air or snow
 	if (params.remove_snow) {
@@ -307,10 +846,9 @@ void WriteXML::WriteVox(XMLElement* element, Shape* shape, int handle) {
 			mvshape.voxels.Set(0, 0, 0, 255);
 		if (mvshape.voxels.Get(sizex - 1, sizey - 1, sizez - 1) == 0 || mvshape.voxels.Get(sizex - 1, sizey - 1, sizez - 1) == 254)
 			mvshape.voxels.Set(sizex - 1, sizey - 1, sizez - 1, 255);
-		vox_file->SetEntry(255, HOLE_COLOR, HOLE_MATERIAL);
+		vox.add_hole = true;
 	}
 
-	const Palette& palette = scene.palettes[shape->voxels.palette_id];
 	for (int z = 0; z < sizez; z++)
 		for (int y = 0; y < sizey; y++)
 			for (int x = 0; x < sizex; x++) {
@@ -320,57 +858,91 @@ void WriteXML::WriteVox(XMLElement* element, Shape* shape, int handle) {
 					if (params.remove_snow && index == 254)
 						mvshape.voxels.Set(x, y, z, 0);
 					// Add used palette entries
-					const Material& palette_entry = palette.materials[index];
-					vox_file->SetEntry(index, ToMV(palette_entry.rgba), ToMV(palette_entry));
+					vox.used[index] = true;
 				}
 			}
-
-	bool duplicated = vox_file->GetShapeName(mvshape, vox_object);
-	if (!duplicated)
-		vox_file->AddShape(mvshape);
+	vox.hash = mvshape.voxels.GetHash();
 
 	bool collide = (shape->shape_flags & 0x10) != 0;
 
 	element->SetName("vox");
-	xml.AddTransformAttribute(element, shape_transform);
-	xml.AddTextureAttribute(element, "texture", shape->texture);
-	xml.AddTextureAttribute(element, "blendtexture", shape->blendtexture);
-	xml.AddFloatAttribute(element, "density", shape->density, "1");
-	xml.AddFloatAttribute(element, "strength", shape->strength, "1");
-	xml.AddBoolAttribute(element, "collide", collide, true);
-
-	xml.AddStringAttribute(element, "file", vox_path);
-	xml.AddStringAttribute(element, "object", vox_object);
-	xml.AddFloatAttribute(element, "scale", 10.0 * shape->voxels.scale, "1");
+	xml->AddTransformAttribute(element, shape_transform);
+	xml->AddTextureAttribute(element, "texture", shape->texture);
+	xml->AddTextureAttribute(element, "blendtexture", shape->blendtexture);
+	xml->AddFloatAttribute(element, "density", shape->density, 1);
+	xml->AddFloatAttribute(element, "strength", shape->strength, 1);
+	xml->AddBoolAttribute(element, "collide", collide, true);
+
+	// Set when the model is added to its file
+	xml->AddStringAttribute(element, "file", vox.group);
+	xml->AddStringAttribute(element, "object", mvshape.name);
+	xml->AddFloatAttribute(element, "scale", 10.0 * shape->voxels.scale, 1);
+	vox.element = element;
+	AddPendingVox(vox);
 }
 
-void WriteXML::WriteVoxbox(XMLElement* element, const Shape* shape) {
-	int sizex = shape->voxels.sizex;
-	int sizey = shape->voxels.sizey;
-	int sizez = shape->voxels.sizez;
-
+void WriteXML::WriteVoxbox(XML_Element* element, const Shape* shape, const VoxelBox& box) {
 	bool collide = (shape->shape_flags & 0x10) != 0;
-	uint8_t index = shape->decoded_voxels.Get(0, 0, 0);
 	const Palette& palette = scene.palettes[shape->voxels.palette_id];
-	const Material& palette_entry = palette.materials[index];
+	const Material& palette_entry = palette.materials[box.index];
+
+	Transform box_transform = shape->transform;
+	if (box.x != 0 || box.y != 0 || box.z != 0)
+		box_transform.pos = box_transform.pos + box_transform.rot * Vec3(0.1f * box.x, 0.1f * box.y, 0.1f * box.z);
 
 	element->SetName("voxbox");
-	xml.AddTransformAttribute(element, shape->transform);
-	xml.AddTextureAttribute(element, "texture", shape->texture);
-	xml.AddTextureAttribute(element, "blendtexture", shape->blendtexture);
-	xml.AddFloatAttribute(element, "density", shape->density, "1");
-	xml.AddFloatAttribute(element, "strength", shape->strength, "1");
-	xml.AddBoolAttribute(element, "collide", collide, true);
-	xml.AddVec3Attribute(element, "size", Vec3(sizex, sizey, sizez), "50 30 20");
-	xml.AddStringAttribute(element, "material", MaterialName[palette_entry.type], "none");
-	xml.AddColorAttribute(element, "color", palette_entry.rgba, "1 1 1");
-	xml.AddVec4Attribute(element, "pbr", Vec4(palette_entry.reflectivity, palette_entry.shinyness, palette_entry.metalness, palette_entry.emissive), "0 0 0 0");
+	xml->AddTransformAttribute(element, box_transform);
+	xml->AddTextureAttribute(element, "texture", shape->texture);
+	xml->AddTextureAttribute(element, "blendtexture", shape->blendtexture);
+	xml->AddFloatAttribute(element, "density", shape->density, 1);
+	xml->AddFloatAttribute(element, "strength", shape->strength, 1);
+	xml->AddBoolAttribute(element, "collide", collide, true);
+	xml->AddVec3Attribute(element, "size", Vec3(box.sizex, box.sizey, box.sizez), Vec3(50, 30, 20));
+	xml->AddStringAttribute(element, "material", MaterialName[palette_entry.type], "none");
+	xml->AddColorAttribute(element, "color", palette_entry.rgba, Color{1, 1, 1, 1});
+	xml->AddVec4Attribute(element, "pbr", Vec4(palette_entry.reflectivity, palette_entry.shinyness, palette_entry.metalness, palette_entry.emissive), Vec4(0, 0, 0, 0));
+}
+
+// Regions filled with a single material are written as voxboxes next to the
+// shape, the voxels left are written as usual. The entity keeps the element
+// of the remaining voxels, or of the first voxbox if nothing is left.
+void WriteXML::WriteVoxboxes(XML_Element* element, Shape* shape, int handle, const string& name, const ShapeEncoding& encoding, vector<XML_Element*>& voxboxes) {
+	const string& desc = entity_mapping.Get(handle)->desc;
+	for (unsigned int i = 0; i < encoding.boxes.size(); i++) {
+		const VoxelBox& box = encoding.boxes[i];
+		XML_Element* box_element = element;
+		if (i > 0 || encoding.remaining_voxels > 0) {
+			box_element = xml->CreateDetachedElement("voxbox");
+			xml->AddStringAttribute(box_element, "desc", desc);
+			voxboxes.push_back(box_element);
+		}
+		WriteVoxbox(box_element, shape, box);
+
+		for (int z = box.z; z < box.z + box.sizez; z++)
+			for (int y = box.y; y < box.y + box.sizey; y++)
+				for (int x = box.x; x < box.x + box.sizex; x++)
+					shape->decoded_voxels.Set(x, y, z, 0);
+	}
+
+	if (encoding.remaining_voxels == 0) {
+		const VoxelBox& box = encoding.boxes[0];
+		if (box.x != 0 || box.y != 0 || box.z != 0)
+			shape->transform.pos = shape->transform.pos + shape->transform.rot * Vec3(0.1f * box.x, 0.1f * box.y, 0.1f * box.z);
+		return;
+	}
+
+	// The boxes usually leave air around the remaining voxels
+	if (!params.keep_shape_extents)
+		TrimShape(shape);
+	if (shape->voxels.sizex <= 256 && shape->voxels.sizey <= 256 && shape->voxels.sizez <= 256)
+		WriteVox(element, shape, handle, name);
+	else
+		WriteCompound(element, shape, handle, name);
 }
 
-void WriteXML::WriteCompound(XMLElement* element, Shape* shape, int handle) {
+void WriteXML::WriteCompound(XML_Element* element, Shape* shape, int handle, const string& name) {
 	int sizex = shape->voxels.sizex;
 	int sizey = shape->voxels.sizey;
-	int sizez = shape->voxels.sizez;
 
 	Vec3 axis_offset(0.05f * (sizex - sizex % 2), 0.05f * (sizey - sizey % 2), 0);
 	axis_offset = axis_offset * (10.0f * shape->voxels.scale);
@@ -382,88 +954,73 @@ void WriteXML::WriteCompound(XMLElement* element, Shape* shape, int handle) {
 	bool collide = (shape->shape_flags & 0x10) != 0;
 
 	element->SetName("compound");
-	xml.AddTransformAttribute(element, shape_transform);
-	xml.AddTextureAttribute(element, "texture", shape->texture);
-	xml.AddTextureAttribute(element, "blendtexture", shape->blendtexture);
-	xml.AddFloatAttribute(element, "density", shape->density, "1");
-	xml.AddFloatAttribute(element, "strength", shape->strength, "1");
-	xml.AddBoolAttribute(element, "collide", collide, true);
-
-	for (int i = 0; i < (sizex + 256 - 1) / 256; i++)
-		for (int j = 0; j < (sizey + 256 - 1) / 256; j++)
-			for (int k = 0; k < (sizez + 256 - 1) / 256; k++)
-				WriteCompoundShape(element, shape, handle, i, j, k);
+	xml->AddTransformAttribute(element, shape_transform);
+	xml->AddTextureAttribute(element, "texture", shape->texture);
+	xml->AddTextureAttribute(element, "blendtexture", shape->blendtexture);
+	xml->AddFloatAttribute(element, "density", shape->density, 1);
+	xml->AddFloatAttribute(element, "strength", shape->strength, 1);
+	xml->AddBoolAttribute(element, "collide", collide, true);
+
+	vector<VoxelBox> parts;
+	SplitCompound(shape->decoded_voxels, parts);
+	for (unsigned int i = 0; i < parts.size(); i++)
+		WriteCompoundShape(element, shape, handle, name, i, parts[i]);
 }
 
-void WriteXML::WriteCompoundShape(XMLElement* parent, const Shape* shape, int handle, int i, int j, int k) {
-	int offsetx = 256 * i;
-	int offsety = 256 * j;
-	int offsetz = 256 * k;
+void WriteXML::WriteCompoundShape(XML_Element* parent, const Shape* shape, int handle, const string& name, int part_index, const VoxelBox& part) {
 	int sizex = shape->voxels.sizex;
 	int sizey = shape->voxels.sizey;
-	int sizez = shape->voxels.sizez;
-	int part_sizex = min(256, sizex - offsetx);
-	int part_sizey = min(256, sizey - offsety);
-	int part_sizez = min(256, sizez - offsetz);
 
-	float pos_x = 25.6 * i + (part_sizex / 2) * 0.1;
-	float pos_y = 25.6 * k;
-	float pos_z = -25.6 * j - (part_sizey / 2) * 0.1;
-	pos_x -= (sizex / 2) * 0.1;
-	pos_z += (sizey / 2) * 0.1;
+	// Positions of the part center relative to the compound, in voxels
+	float pos_x = 0.1 * (part.x + part.sizex / 2 - sizex / 2);
+	float pos_y = 0.1 * part.z;
+	float pos_z = -0.1 * (part.y + part.sizey / 2 - sizey / 2);
 
 	int mv_pos_x = 10 * pos_x;
 	int mv_pos_y = -10 * pos_z;
-	int mv_pos_z = 10 * pos_y + part_sizez / 2 + part_sizez % 2;
-
-	string vox_folder = params.legacy_format ? "custom/" : "vox/";
-	string vox_filename ="palette" + to_string(shape->voxels.palette_id) + ".vox";
-	string vox_full_path = params.map_folder + vox_folder + vox_filename;
-	string path_prefix = params.legacy_format ? "LEVEL/" : "MOD/vox/";
-	string vox_path = path_prefix + vox_filename;
-	string vox_object = "shape" + to_string(handle) + "_part" + to_string(i) + to_string(j) + to_string(k);
-
-	MV_FILE* vox_file;
-	if (vox_files.find(shape->voxels.palette_id) == vox_files.end()) {
-		vox_file = new MV_FILE(vox_full_path);
-		vox_files[shape->voxels.palette_id] = vox_file;
-	} else
-		vox_file = vox_files[shape->voxels.palette_id];
-
-	MV_Shape mvshape = { vox_object, mv_pos_x, mv_pos_y, mv_pos_z, Tensor3D(part_sizex, part_sizey, part_sizez) };
-	mvshape.voxels.Set(0, 0, 0, 255);
-	mvshape.voxels.Set(part_sizex - 1, part_sizey - 1, part_sizez - 1, 255);
-	vox_file->SetEntry(255, HOLE_COLOR, HOLE_MATERIAL);
+	int mv_pos_z = 10 * pos_y + part.sizez / 2 + part.sizez % 2;
+
+	PendingVox vox;
+	vox.group = GetVoxGroup(shape, handle);
+	vox.mvshape = { name + "_part" + to_string(part_index), mv_pos_x, mv_pos_y, mv_pos_z,
+					shape->decoded_voxels.Crop(part.x, part.y, part.z, part.sizex, part.sizey, part.sizez) };
+	vox.mvshape.handle = handle;
+	vox.add_hole = false;
+	vox.palette_id = shape->voxels.palette_id;
+	MV_Shape& mvshape = vox.mvshape;
+	// The part is tight around its voxels, keep its size when removing snow
+	if (params.remove_snow) {
+		if (mvshape.voxels.Get(0, 0, 0) == 0 || mvshape.voxels.Get(0, 0, 0) == 254)
+			mvshape.voxels.Set(0, 0, 0, 255);
+		if (mvshape.voxels.Get(part.sizex - 1, part.sizey - 1, part.sizez - 1) == 0 ||
+			mvshape.voxels.Get(part.sizex - 1, part.sizey - 1, part.sizez - 1) == 254)
+			mvshape.voxels.Set(part.sizex - 1, part.sizey - 1, part.sizez - 1, 255);
+		vox.add_hole = true;
+	}
 
-	bool empty = true;
-	const Palette& palette = scene.palettes[shape->voxels.palette_id];
-	for (int z = offsetz; z < part_sizez + offsetz; z++)
-		for (int y = offsety; y < part_sizey + offsety; y++)
-			for (int x = offsetx; x < part_sizex + offsetx; x++) {
-				uint8_t index = shape->decoded_voxels.Get(x, y, z);
+	for (int z = 0; z < part.sizez; z++)
+		for (int y = 0; y < part.sizey; y++)
+			for (int x = 0; x < part.sizex; x++) {
+				uint8_t index = shape->decoded_voxels.Get(part.x + x, part.y + y, part.z + z);
 				if (index != 0) {
-					// Add voxels that are not snow
-					if (!params.remove_snow || index != 254)
-						mvshape.voxels.Set(x - offsetx, y - offsety, z - offsetz, index);
+					// Remove snow voxels
+					if (params.remove_snow && index == 254)
+						mvshape.voxels.Set(x, y, z, 0);
 					// Add used palette entries
-					const Material& palette_entry = palette.materials[index];
-					vox_file->SetEntry(index, ToMV(palette_entry.rgba), ToMV(palette_entry));
-					empty = false;
+					vox.used[index] = true;
 				}
 			}
-	if (!empty) {
-		bool duplicated = vox_file->GetShapeName(mvshape, vox_object);
-		if (!duplicated)
-			vox_file->AddShape(mvshape);
-
-		XMLElement* shape_xml = xml.AddChildElement(parent, "vox");
-		xml.AddVec3Attribute(shape_xml, "pos", Vec3(pos_x, pos_y, pos_z), "0 0 0");
-		xml.AddStringAttribute(shape_xml, "file", vox_path);
-		xml.AddStringAttribute(shape_xml, "object", vox_object);
-	}
+	vox.hash = mvshape.voxels.GetHash();
+
+	vox.element = xml->AddChildElement(parent, "vox");
+	xml->AddVec3Attribute(vox.element, "pos", Vec3(pos_x, pos_y, pos_z), Vec3(0, 0, 0));
+	// Set when the model is added to its file
+	xml->AddStringAttribute(vox.element, "file", vox.group);
+	xml->AddStringAttribute(vox.element, "object", mvshape.name);
+	AddPendingVox(vox);
 }
 
-void WriteXML::WriteLight(XMLElement* element, const Light* light, const Entity* parent) {
+void WriteXML::WriteLight(XML_Element* element, const Light* light, const Entity* parent) {
 	Color light_color = light->color;
 	light_color.r = pow(light->color.r, 1 / 2.2f);
 	light_color.g = pow(light->color.g, 1 / 2.2f);
@@ -472,56 +1029,56 @@ void WriteXML::WriteLight(XMLElement* element, const Light* light, const Entity*
 	element->SetName("light");
 	// Assuming lights are at the center of the screen or another light
 	if (parent == nullptr || (parent->type != Entity::Screen && parent->type != Entity::Light))
-		xml.AddTransformAttribute(element, GetLocalTransform(parent, light->transform));
-	xml.AddStringAttribute(element, "type", LightName[light->type], "sphere");
-	xml.AddColorAttribute(element, "color", light_color, "1 1 1");
-	xml.AddFloatAttribute(element, "scale", light->scale, "1");
+		xml->AddTransformAttribute(element, GetLocalTransform(parent, light->transform));
+	xml->AddStringAttribute(element, "type", LightName[light->type], "sphere");
+	xml->AddColorAttribute(element, "color", light_color, Color{1, 1, 1, 1});
+	xml->AddFloatAttribute(element, "scale", light->scale, 1);
 
 	if (light->type == Light::Cone) {
-		xml.AddFloatAttribute(element, "angle", 2.0 * deg(acos(light->angle)), "90");
-		xml.AddFloatAttribute(element, "penumbra", 2.0 * deg(acos(light->angle) - acos(light->penumbra)), "10");
+		xml->AddFloatAttribute(element, "angle", 2.0 * deg(acos(light->angle)), 90);
+		xml->AddFloatAttribute(element, "penumbra", 2.0 * deg(acos(light->angle) - acos(light->penumbra)), 10);
 	}
 
 	if (light->type == Light::Area)
-		xml.AddVec2Attribute(element, "size", Vec2(2.0 * light->area_size[0], 2.0 * light->area_size[1]), "0.1 0");
+		xml->AddVec2Attribute(element, "size", Vec2(2.0 * light->area_size[0], 2.0 * light->area_size[1]), Vec2(0.1, 0));
 	else if (light->type == Light::Capsule)
-		xml.AddVec2Attribute(element, "size", Vec2(2.0 * light->capsule_size, light->size), "0.1 0");
+		xml->AddVec2Attribute(element, "size", Vec2(2.0 * light->capsule_size, light->size), Vec2(0.1, 0));
 	else
-		xml.AddFloatAttribute(element, "size", light->size, "0.1");
-
-	xml.AddFloatAttribute(element, "reach", light->reach, "0");
-	xml.AddFloatAttribute(element, "unshadowed", light->unshadowed, "0");
-	xml.AddFloatAttribute(element, "fogscale", light->fogscale, "1");
-	xml.AddFloatAttribute(element, "fogiter", light->fogiter, "1");
-	xml.AddSoundAttribute(element, "sound", light->sound, "");
-	xml.AddFloatAttribute(element, "glare", light->glare, "0");
-	xml.AddStringAttribute(element, "breaksound", light->breaksound);
+		xml->AddFloatAttribute(element, "size", light->size, 0.1);
+
+	xml->AddFloatAttribute(element, "reach", light->reach, 0);
+	xml->AddFloatAttribute(element, "unshadowed", light->unshadowed, 0);
+	xml->AddFloatAttribute(element, "fogscale", light->fogscale, 1);
+	xml->AddFloatAttribute(element, "fogiter", light->fogiter, 1);
+	xml->AddSoundAttribute(element, "sound", light->sound, "");
+	xml->AddFloatAttribute(element, "glare", light->glare, 0);
+	xml->AddStringAttribute(element, "breaksound", light->breaksound);
 }
 
-void WriteXML::WriteLocation(XMLElement* element, const Location* location, const Entity* parent) {
+void WriteXML::WriteLocation(XML_Element* element, const Location* location, const Entity* parent) {
 	element->SetName("location");
 	if (parent == nullptr || parent->type != Entity::Trigger)
-		xml.AddTransformAttribute(element, GetLocalTransform(parent, location->transform));
+		xml->AddTransformAttribute(element, GetLocalTransform(parent, location->transform));
 }
 
-void WriteXML::WriteWater(XMLElement* element, const Water* water) {
+void WriteXML::WriteWater(XML_Element* element, const Water* water) {
 	element->SetName("water");
-	xml.AddTransformAttribute(element, water->transform);
-	xml.AddStringAttribute(element, "type", "polygon");
-	xml.AddFloatAttribute(element, "depth", water->depth, "10");
-	xml.AddFloatAttribute(element, "wave", water->wave, "0.5");
-	xml.AddFloatAttribute(element, "ripple", water->ripple, "0.5");
-	xml.AddFloatAttribute(element, "ringheight", water->ringheight, "0.8");
-	xml.AddFloatAttribute(element, "motion", water->motion, "0.5");
-	xml.AddColorAttribute(element, "color", water->color, "0.01 0.01 0.01");
-	xml.AddVec4Attribute(element, "pbr", Vec4(water->pbr), "0.02 1 0 0");
-	xml.AddFloatAttribute(element, "drag", water->drag, "0.005");
-
-	xml.AddFloatAttribute(element, "foam", water->foam, "0.5");
-	xml.AddFloatAttribute(element, "foamscale", water->foam_props.scale, "0.13");
-	xml.AddFloatAttribute(element, "foamscalelarge", water->foam_props.scalelarge, "0.009");
-	xml.AddFloatAttribute(element, "foamscalesmall", water->foam_props.scalesmall, "0.52");
-	xml.AddStringAttribute(element, "foamtexture", water->foam_props.texture);
+	xml->AddTransformAttribute(element, water->transform);
+	xml->AddStringAttribute(element, "type", "polygon");
+	xml->AddFloatAttribute(element, "depth", water->depth, 10);
+	xml->AddFloatAttribute(element, "wave", water->wave, 0.5);
+	xml->AddFloatAttribute(element, "ripple", water->ripple, 0.5);
+	xml->AddFloatAttribute(element, "ringheight", water->ringheight, 0.8);
+	xml->AddFloatAttribute(element, "motion", water->motion, 0.5);
+	xml->AddColorAttribute(element, "color", water->color, Color{0.01, 0.01, 0.01, 1});
+	xml->AddVec4Attribute(element, "pbr", Vec4(water->pbr), Vec4(0.02, 1, 0, 0));
+	xml->AddFloatAttribute(element, "drag", water->drag, 0.005);
+
+	xml->AddFloatAttribute(element, "foam", water->foam, 0.5);
+	xml->AddFloatAttribute(element, "foamscale", water->foam_props.scale, 0.13);
+	xml->AddFloatAttribute(element, "foamscalelarge", water->foam_props.scalelarge, 0.009);
+	xml->AddFloatAttribute(element, "foamscalesmall", water->foam_props.scalesmall, 0.52);
+	xml->AddStringAttribute(element, "foamtexture", water->foam_props.texture);
 
 	static const char* colorModes[] = {
 		"off", "add", "mul", "blend"
@@ -533,43 +1090,43 @@ void WriteXML::WriteWater(XMLElement* element, const Water* water) {
 	if (coloremitmode < 12) {
 		string foamcolormode = colorModes[coloremitmode % 4];
 		string foamemitmode  = emitModes[coloremitmode / 4];
-		xml.AddStringAttribute(element, "foamcolormode", foamcolormode, "add");
-		xml.AddStringAttribute(element, "foamemitmode", foamemitmode, "off");
+		xml->AddStringAttribute(element, "foamcolormode", foamcolormode, "add");
+		xml->AddStringAttribute(element, "foamemitmode", foamemitmode, "off");
 	} else {
 		printf("[WARNING] Unsupported foam color/emit mode %d\n", coloremitmode);
 	}
-	xml.AddIntAttribute(element, "splashtexture", water->splashtexture, 0);
-
-	xml.AddColorAttribute(element, "sp_color_a", water->splash_particle.color_a, "1 1 1");
-	xml.AddColorAttribute(element, "sp_color_b", water->splash_particle.color_b, "1 1 1");
-	xml.AddFloatAttribute(element, "sp_alpha_a", water->splash_particle.alpha_a, "0.5");
-	xml.AddFloatAttribute(element, "sp_alpha_b", water->splash_particle.alpha_b, "0");
-	xml.AddFloatAttribute(element, "sp_emissive_a", water->splash_particle.emissive_a, "0");
-	xml.AddFloatAttribute(element, "sp_emissive_b", water->splash_particle.emissive_b, "0");
-	xml.AddFloatAttribute(element, "sp_drag", water->splash_particle.drag, "0.1");
-	xml.AddFloatAttribute(element, "sp_stretch", water->splash_particle.stretch, "10");
-	xml.AddFloatAttribute(element, "sp_lifetime", water->splash_particle.lifetime, "1.5");
-	xml.AddFloatAttribute(element, "sp_lifetime_rnd", water->splash_particle.lifetime_rnd, "0.5");
-	xml.AddFloatAttribute(element, "sp_gravity", water->splash_particle.gravity, "-7.5");
-	xml.AddFloatAttribute(element, "sp_gravity_rnd", water->splash_particle.gravity_rnd, "2.5");
-	xml.AddFloatAttribute(element, "sp_velocityscale", water->splash_particle.velocityscale, "1");
-
-	xml.AddStringAttribute(element, "snd_splash_small", water->sound.splash_small);
-	xml.AddStringAttribute(element, "snd_splash_medium", water->sound.do_float);
-	xml.AddStringAttribute(element, "snd_splash_large", water->sound.splash_large);
-	xml.AddStringAttribute(element, "snd_float", water->sound.do_float);
-	xml.AddStringAttribute(element, "snd_underwater", water->sound.underwater);
-
-	xml.AddFloatAttribute(element, "visibility", water->visibility, "3");
-	xml.AddVerticesAttribute(element, water->vertices);
+	xml->AddIntAttribute(element, "splashtexture", water->splashtexture, 0);
+
+	xml->AddColorAttribute(element, "sp_color_a", water->splash_particle.color_a, Color{1, 1, 1, 1});
+	xml->AddColorAttribute(element, "sp_color_b", water->splash_particle.color_b, Color{1, 1, 1, 1});
+	xml->AddFloatAttribute(element, "sp_alpha_a", water->splash_particle.alpha_a, 0.5);
+	xml->AddFloatAttribute(element, "sp_alpha_b", water->splash_particle.alpha_b, 0);
+	xml->AddFloatAttribute(element, "sp_emissive_a", water->splash_particle.emissive_a, 0);
+	xml->AddFloatAttribute(element, "sp_emissive_b", water->splash_particle.emissive_b, 0);
+	xml->AddFloatAttribute(element, "sp_drag", water->splash_particle.drag, 0.1);
+	xml->AddFloatAttribute(element, "sp_stretch", water->splash_particle.stretch, 10);
+	xml->AddFloatAttribute(element, "sp_lifetime", water->splash_particle.lifetime, 1.5);
+	xml->AddFloatAttribute(element, "sp_lifetime_rnd", water->splash_particle.lifetime_rnd, 0.5);
+	xml->AddFloatAttribute(element, "sp_gravity", water->splash_particle.gravity, -7.5);
+	xml->AddFloatAttribute(element, "sp_gravity_rnd", water->splash_particle.gravity_rnd, 2.5);
+	xml->AddFloatAttribute(element, "sp_velocityscale", water->splash_particle.velocityscale, 1);
+
+	xml->AddStringAttribute(element, "snd_splash_small", water->sound.splash_small);
+	xml->AddStringAttribute(element, "snd_splash_medium", water->sound.do_float);
+	xml->AddStringAttribute(element, "snd_splash_large", water->sound.splash_large);
+	xml->AddStringAttribute(element, "snd_float", water->sound.do_float);
+	xml->AddStringAttribute(element, "snd_underwater", water->sound.underwater);
+
+	xml->AddFloatAttribute(element, "visibility", water->visibility, 3);
+	xml->AddVerticesAttribute(element, water->vertices);
 }
 
 void WriteXML::WriteJoint(const Joint* joint, string tags) {
 	uint32_t shape_handle = joint->shapes[0];
 	if (shape_handle == 0) return;
-	assert(entity_mapping.find(shape_handle) != entity_mapping.end());
-	Entity* parent_entity = entity_mapping[shape_handle];
-	XMLElement* parent_element = xml.GetEntityElement(shape_handle);
+	Entity* parent_entity = entity_mapping.Get(shape_handle);
+	assert(parent_entity != nullptr);
+	XML_Element* parent_element = xml->GetEntityElement(shape_handle);
 	assert(parent_element != nullptr);
 
 	Vec3 relative_pos = joint->positions[0];
@@ -599,36 +1156,36 @@ void WriteXML::WriteJoint(const Joint* joint, string tags) {
 	Transform joint_tr = Transform(relative_pos, relative_rot);
 	joint_tr = GetLocalTransform(parent_entity, joint_tr);
 
-	XMLElement* element = xml.AddChildElement(parent_element, "joint");
-	xml.AddStringAttribute(element, "tags", tags);
-	xml.AddTransformAttribute(element, joint_tr);
+	XML_Element* element = xml->AddChildElement(parent_element, "joint");
+	xml->AddStringAttribute(element, "tags", tags);
+	xml->AddTransformAttribute(element, joint_tr);
 
 	if (joint->type == Joint::Hinge)
-		xml.AddStringAttribute(element, "type", "hinge");
+		xml->AddStringAttribute(element, "type", "hinge");
 	else if (joint->type == Joint::Prismatic)
-		xml.AddStringAttribute(element, "type", "prismatic");
+		xml->AddStringAttribute(element, "type", "prismatic");
 	else if (joint->type == Joint::Cone)
-		xml.AddStringAttribute(element, "type", "cone");
+		xml->AddStringAttribute(element, "type", "cone");
 
-	xml.AddFloatAttribute(element, "size", joint->size, "0.1");
+	xml->AddFloatAttribute(element, "size", joint->size, 0.1);
 	if (joint->type != Joint::Prismatic) {
-		xml.AddFloatAttribute(element, "rotstrength", joint->rotstrength, "0");
-		xml.AddFloatAttribute(element, "rotspring", joint->rotspring, "0.5");
+		xml->AddFloatAttribute(element, "rotstrength", joint->rotstrength, 0);
+		xml->AddFloatAttribute(element, "rotspring", joint->rotspring, 0.5);
 	}
-	xml.AddBoolAttribute(element, "collide", joint->collide, false);
+	xml->AddBoolAttribute(element, "collide", joint->collide, false);
 	if (joint->type == Joint::Hinge || joint->type == Joint::Cone) {
 		Vec2 limits = joint->limits;
 		limits.x = deg(limits.x);
 		limits.y = deg(limits.y);
-		xml.AddVec2Attribute(element, "limits", limits, "0 0");
+		xml->AddVec2Attribute(element, "limits", limits, Vec2(0, 0));
 	} else if (joint->type == Joint::Prismatic)
-		xml.AddVec2Attribute(element, "limits", joint->limits, "0 0");
-	xml.AddBoolAttribute(element, "sound", joint->sound, false);
+		xml->AddVec2Attribute(element, "limits", joint->limits, Vec2(0, 0));
+	xml->AddBoolAttribute(element, "sound", joint->sound, false);
 	if (joint->type == Joint::Prismatic)
-		xml.AddBoolAttribute(element, "autodisable", joint->autodisable, false);
+		xml->AddBoolAttribute(element, "autodisable", joint->autodisable, false);
 }
 
-void WriteXML::WriteRope(XMLElement* element, const Rope* rope, float size) {
+void WriteXML::WriteRope(XML_Element* element, const Rope* rope, float size) {
 	int knot_count = rope->segments.getSize();
 	if (knot_count < 2)
 		return;
@@ -639,80 +1196,79 @@ void WriteXML::WriteRope(XMLElement* element, const Rope* rope, float size) {
 	float slack = rope->slack - rope_length;
 
 	element->SetName("rope");
-	xml.AddFloatAttribute(element, "size", size, "0.2");
-	xml.AddColorAttribute(element, "color", rope->color, "0 0 0");
-	xml.AddFloatAttribute(element, "slack", slack, "0");
-	xml.AddFloatAttribute(element, "strength", rope->strength, "1");
-	xml.AddFloatAttribute(element, "maxstretch", rope->maxstretch, "0");
-
-	XMLElement* location_from = xml.AddChildElement(element, "location");
-	xml.AddVec3Attribute(location_from, "pos", rope_start, "0 0 0");
-	XMLElement* location_to = xml.AddChildElement(element, "location");
-	xml.AddVec3Attribute(location_to, "pos", rope_end, "0 0 0");
+	xml->AddFloatAttribute(element, "size", size, 0.2);
+	xml->AddColorAttribute(element, "color", rope->color, Color{0, 0, 0, 1});
+	xml->AddFloatAttribute(element, "slack", slack, 0);
+	xml->AddFloatAttribute(element, "strength", rope->strength, 1);
+	xml->AddFloatAttribute(element, "maxstretch", rope->maxstretch, 0);
+
+	XML_Element* location_from = xml->AddChildElement(element, "location");
+	xml->AddVec3Attribute(location_from, "pos", rope_start, Vec3(0, 0, 0));
+	XML_Element* location_to = xml->AddChildElement(element, "location");
+	xml->AddVec3Attribute(location_to, "pos", rope_end, Vec3(0, 0, 0));
 }
 
-void WriteXML::WriteVehicle(XMLElement* element, const Vehicle* vehicle, bool is_boat) {
+void WriteXML::WriteVehicle(XML_Element* element, const Vehicle* vehicle, bool is_boat) {
 	element->SetName("vehicle");
-	xml.AddTransformAttribute(element, vehicle->transform);
-	xml.AddSoundAttribute(element, "sound", vehicle->properties.sound, "medium");
-	xml.AddFloatAttribute(element, "spring", vehicle->properties.spring, "1");
-	xml.AddFloatAttribute(element, "damping", vehicle->properties.damping, "1");
-	xml.AddFloatAttribute(element, "topspeed", 3.6 * vehicle->properties.topspeed, "70");
-	xml.AddFloatAttribute(element, "acceleration", vehicle->properties.acceleration, "1");
-	xml.AddFloatAttribute(element, "strength", vehicle->properties.strength, "1");
-	xml.AddFloatAttribute(element, "antispin", vehicle->properties.antispin, "0");
-	xml.AddFloatAttribute(element, "antiroll", vehicle->properties.antiroll, "0");
-	xml.AddFloatAttribute(element, "difflock", vehicle->difflock, "0");
-	xml.AddFloatAttribute(element, "steerassist", vehicle->properties.steerassist, "0");
-	xml.AddFloatAttribute(element, "friction", vehicle->properties.friction, "1.3");
-
-	int exhausts_count = vehicle->exhausts.getSize();
-	for (int i = 0; i < exhausts_count; i++) {
-		XMLElement* exhaust = xml.AddChildElement(element, "location");
-		xml.AddExhaustTagAttribute(exhaust, vehicle->exhausts[i].strength);
-		xml.AddTransformAttribute(exhaust, vehicle->exhausts[i].transform);
+	xml->AddTransformAttribute(element, vehicle->transform);
+	xml->AddSoundAttribute(element, "sound", vehicle->properties.sound, "medium");
+	xml->AddFloatAttribute(element, "spring", vehicle->properties.spring, 1);
+	xml->AddFloatAttribute(element, "damping", vehicle->properties.damping, 1);
+	xml->AddFloatAttribute(element, "topspeed", 3.6 * vehicle->properties.topspeed, 70);
+	xml->AddFloatAttribute(element, "acceleration", vehicle->properties.acceleration, 1);
+	xml->AddFloatAttribute(element, "strength", vehicle->properties.strength, 1);
+	xml->AddFloatAttribute(element, "antispin", vehicle->properties.antispin, 0);
+	xml->AddFloatAttribute(element, "antiroll", vehicle->properties.antiroll, 0);
+	xml->AddFloatAttribute(element, "difflock", vehicle->difflock, 0);
+	xml->AddFloatAttribute(element, "steerassist", vehicle->properties.steerassist, 0);
+	xml->AddFloatAttribute(element, "friction", vehicle->properties.friction, 1.3);
+
+	for (Vec<Exhaust>::const_iterator it = vehicle->exhausts.begin(); it != vehicle->exhausts.end(); it++) {
+		XML_Element* exhaust = xml->AddChildElement(element, "location");
+		xml->AddExhaustTagAttribute(exhaust, it->strength);
+		xml->AddTransformAttribute(exhaust, it->transform);
 	}
 
 	if (!vehicle->player.isZero()) {
-		XMLElement* player = xml.AddChildElement(element, "location");
-		xml.AddStringAttribute(player, "tags", "player");
+		XML_Element* player = xml->AddChildElement(element, "location");
+		xml->AddStringAttribute(player, "tags", "player");
 		Transform transform;
 		transform.pos = vehicle->player;
 		transform.rot = QuatEuler(0, 180, 0);
-		xml.AddTransformAttribute(player, transform);
+		xml->AddTransformAttribute(player, transform);
 	}
 
 	if (!vehicle->camera.isZero() && vehicle->camera != vehicle->player) {
-		XMLElement* camera = xml.AddChildElement(element, "location");
-		xml.AddStringAttribute(camera, "tags", "camera");
-		xml.AddVec3Attribute(camera, "pos", vehicle->camera, "0 0 0");
+		XML_Element* camera = xml->AddChildElement(element, "location");
+		xml->AddStringAttribute(camera, "tags", "camera");
+		xml->AddVec3Attribute(camera, "pos", vehicle->camera, Vec3(0, 0, 0));
 	}
 
 	if (!vehicle->exit.isZero()) {
-		XMLElement* exit = xml.AddChildElement(element, "location");
-		xml.AddStringAttribute(exit, "tags", "exit");
-		xml.AddVec3Attribute(exit, "pos", vehicle->exit, "0 0 0");
+		XML_Element* exit = xml->AddChildElement(element, "location");
+		xml->AddStringAttribute(exit, "tags", "exit");
+		xml->AddVec3Attribute(exit, "pos", vehicle->exit, Vec3(0, 0, 0));
 	}
 
 	if (is_boat) {
-		XMLElement* propeller = xml.AddChildElement(element, "location");
-		xml.AddStringAttribute(propeller, "tags", "propeller");
-		xml.AddVec3Attribute(propeller, "pos", vehicle->propeller, "0 0 0");
+		XML_Element* propeller = xml->AddChildElement(element, "location");
+		xml->AddStringAttribute(propeller, "tags", "propeller");
+		xml->AddVec3Attribute(propeller, "pos", vehicle->propeller, Vec3(0, 0, 0));
 	}
 }
 
-void WriteXML::WriteWheel(XMLElement* element, const Wheel* wheel, const Entity* parent) {
+void WriteXML::WriteWheel(XML_Element* element, const Wheel* wheel, const Entity* parent) {
 	element->SetName("wheel");
 	if (parent != nullptr && parent->type == Entity::Body)
-		xml.AddTransformAttribute(element, wheel->transform);
+		xml->AddTransformAttribute(element, wheel->transform);
 	else
-		xml.AddTransformAttribute(element, GetLocalTransform(parent, wheel->transform));
-	xml.AddFloatAttribute(element, "drive", wheel->drive, "0");
-	xml.AddFloatAttribute(element, "steer", wheel->steer, "0");
-	xml.AddVec2Attribute(element, "travel", wheel->travel, "-0.1 0.1");
+		xml->AddTransformAttribute(element, GetLocalTransform(parent, wheel->transform));
+	xml->AddFloatAttribute(element, "drive", wheel->drive, 0);
+	xml->AddFloatAttribute(element, "steer", wheel->steer, 0);
+	xml->AddVec2Attribute(element, "travel", wheel->travel, Vec2(-0.1, 0.1));
 }
 
-void WriteXML::WriteScreen(XMLElement* element, const Screen* screen, const Entity* parent) {
+void WriteXML::WriteScreen(XML_Element* element, const Screen* screen, const Entity* parent) {
 	string script_file = screen->script;
 	if (!params.level_id.empty()) {
 		string prefix = "data/level/" + params.level_id;
@@ -726,46 +1282,46 @@ void WriteXML::WriteScreen(XMLElement* element, const Screen* screen, const Enti
 	element->SetName("screen");
 
 	if (parent != nullptr && parent->type == Entity::Shape) {
-		Shape* shape = static_cast<Shape*>(parent->self);
+		Shape* shape = &scene.shapes[parent->index];
 		Transform local_transform = TransformToLocalTransform(shape->original_tr, shape->transform);
 		local_transform = TransformToLocalTransform(local_transform, screen->transform);
-		xml.AddTransformAttribute(element, local_transform);
+		xml->AddTransformAttribute(element, local_transform);
 	}
 
-	xml.AddVec2Attribute(element, "size", screen->size, "0.9 0.5");
-	xml.AddFloatAttribute(element, "bulge", screen->bulge, "0.08");
-	xml.AddVec2Attribute(element, "resolution", Vec2(screen->resolution[0], screen->resolution[1]), "640 480");
-	xml.AddStringAttribute(element, "script", script_file);
-	xml.AddBoolAttribute(element, "enabled", screen->enabled, false);
-	xml.AddBoolAttribute(element, "interactive", screen->interactive, false);
-	xml.AddFloatAttribute(element, "emissive", screen->emissive, "1");
-	xml.AddFloatAttribute(element, "fxraster", screen->fxraster, "0");
-	xml.AddFloatAttribute(element, "fxca", screen->fxca, "0");
-	xml.AddFloatAttribute(element, "fxnoise", screen->fxnoise, "0");
-	xml.AddFloatAttribute(element, "fxglitch", screen->fxglitch, "0");
+	xml->AddVec2Attribute(element, "size", screen->size, Vec2(0.9, 0.5));
+	xml->AddFloatAttribute(element, "bulge", screen->bulge, 0.08);
+	xml->AddVec2Attribute(element, "resolution", Vec2(screen->resolution[0], screen->resolution[1]), Vec2(640, 480));
+	xml->AddStringAttribute(element, "script", script_file);
+	xml->AddBoolAttribute(element, "enabled", screen->enabled, false);
+	xml->AddBoolAttribute(element, "interactive", screen->interactive, false);
+	xml->AddFloatAttribute(element, "emissive", screen->emissive, 1);
+	xml->AddFloatAttribute(element, "fxraster", screen->fxraster, 0);
+	xml->AddFloatAttribute(element, "fxca", screen->fxca, 0);
+	xml->AddFloatAttribute(element, "fxnoise", screen->fxnoise, 0);
+	xml->AddFloatAttribute(element, "fxglitch", screen->fxglitch, 0);
 }
 
-void WriteXML::WriteTrigger(XMLElement* element, const Trigger* trigger) {
+void WriteXML::WriteTrigger(XML_Element* element, const Trigger* trigger) {
 	element->SetName("trigger");
 	Transform trigger_transform = trigger->transform;
 	if (trigger->type == Trigger::Box) {
 		Vec3 offset = Vec3(0, trigger->box_size.y, 0);
 		trigger_transform.pos = trigger_transform.pos - trigger_transform.rot * offset;
 	}
-	xml.AddTransformAttribute(element, trigger_transform);
+	xml->AddTransformAttribute(element, trigger_transform);
 
 	if (trigger->type == Trigger::Sphere)
-		xml.AddFloatAttribute(element, "size", trigger->sphere_size, "10");
+		xml->AddFloatAttribute(element, "size", trigger->sphere_size, 10);
 	else if (trigger->type == Trigger::Box) {
-		xml.AddStringAttribute(element, "type", "box");
-		xml.AddVec3Attribute(element, "size", trigger->box_size * 2.0, "10 10 10");
+		xml->AddStringAttribute(element, "type", "box");
+		xml->AddVec3Attribute(element, "size", trigger->box_size * 2.0, Vec3(10, 10, 10));
 	} else if (trigger->type == Trigger::Polygon) {
-		xml.AddStringAttribute(element, "type", "polygon");
-		xml.AddFloatAttribute(element, "size", trigger->polygon_size, "10");
-		xml.AddVerticesAttribute(element, trigger->polygon_vertices);
+		xml->AddStringAttribute(element, "type", "polygon");
+		xml->AddFloatAttribute(element, "size", trigger->polygon_size, 10);
+		xml->AddVerticesAttribute(element, trigger->polygon_vertices);
 	}
-	xml.AddSoundAttribute(element, "sound", {trigger->sound.path, trigger->sound.volume}, "");
-	xml.AddFloatAttribute(element, "soundramp", trigger->sound.ramp, "2");
+	xml->AddSoundAttribute(element, "sound", {trigger->sound.path, trigger->sound.volume}, "");
+	xml->AddFloatAttribute(element, "soundramp", trigger->sound.ramp, 2);
 }
 
 void WriteXML::WriteScript(const Script* script) {
@@ -800,106 +1356,105 @@ void WriteXML::WriteScript(const Script* script) {
 		script_file == "spawn.lua")
 		return;
 
-	XMLElement* script_element = xml.AddChildElement(xml.GetGroupElement(SCRIPT), "script");
-	xml.AddStringAttribute(script_element, "file", script_file);
+	XML_Element* script_element = xml->AddChildElement(xml->GetGroupElement(SCRIPT), "script");
+	xml->AddStringAttribute(script_element, "file", script_file);
 	for (unsigned int i = 0; i < script->client_core.params.getSize(); i++) {
 		string param_index = "param" + to_string(i);
-		string param = script->client_core.params[i].name;
-		if (script->client_core.params[i].value.length() > 0)
-			param += "=" + script->client_core.params[i].value;
-		xml.AddStringAttribute(script_element, param_index.c_str(), param);
+		const Tag& script_param = script->client_core.params[i];
+		string param = script_param.name;
+		if (script_param.value.length() > 0)
+			param += "=" + script_param.value;
+		xml->AddStringAttribute(script_element, param_index.c_str(), param);
 	}
 
-	for (unsigned int i = 0; i < script->client_core.entities.getSize(); i++) {
-		uint32_t entity_handle = script->client_core.entities[i];
-		XMLElement* entity_element = xml.GetEntityElement(entity_handle);
+	unordered_set<const XML_Element*> script_elements;
+	const Vec<uint32_t>& script_entities = script->client_core.entities;
+	for (Vec<uint32_t>::const_iterator it = script_entities.begin(); it != script_entities.end(); it++) {
+		XML_Element* entity_element = xml->GetEntityElement(*it);
+		if (entity_element != nullptr)
+			script_elements.insert(entity_element);
+	}
+
+	for (Vec<uint32_t>::const_iterator it = script_entities.begin(); it != script_entities.end(); it++) {
+		XML_Element* entity_element = xml->GetEntityElement(*it);
 		if (entity_element == nullptr)
 			continue;
 
 		// Check if some xml parent is also inside the script
 		bool script_includes_parent = false;
-		XMLElement* parent_element = nullptr;
-		if (entity_element->Parent() != nullptr)
-			parent_element = entity_element->Parent()->ToElement();
+		XML_Element* parent_element = entity_element->Parent();
 		while (parent_element != nullptr && !script_includes_parent) {
-			for (unsigned int j = 0; j < script->client_core.entities.getSize(); j++) {
-				uint32_t other_handle = script->client_core.entities[j];
-				if (other_handle == entity_handle)
-					continue;
-				XMLElement* other_element = xml.GetEntityElement(other_handle);
-				if (parent_element == other_element) {
-					script_includes_parent = true;
-					break;
-				}
-			}
-			if (parent_element->Parent() != nullptr)
-				parent_element = parent_element->Parent()->ToElement();
-			else
-				parent_element = nullptr;
+			script_includes_parent = script_elements.find(parent_element) != script_elements.end();
+			parent_element = parent_element->Parent();
 		}
 		if (script_includes_parent)
 			continue;
 
 		// Move script inside the parent of this entity, if it's not a group
 		assert(entity_element->Parent() != nullptr);
-		parent_element = entity_element->Parent()->ToElement();
-		if (parent_element != xml.GetScene() && parent_element->Name() != string("group"))
+		parent_element = entity_element->Parent();
+		if (parent_element != xml->GetScene() && parent_element->Name() != string("group"))
 			parent_element->InsertEndChild(script_element);
 
 		// Move entity inside the script
 		// Do not move ropes, the script may have been moved inside a body
 		if (entity_element->Name() != string("rope"))
-			xml.AddEntityElement(script_element, entity_element, entity_handle);
+			xml->AddEntityElement(script_element, entity_element, *it);
 	}
 }
 
-void WriteXML::WriteAnimator(XMLElement* element, const Animator* animator) {
+void WriteXML::WriteAnimator(XML_Element* element, const Animator* animator) {
 	element->SetName("animator");
-	xml.AddStringAttribute(element, "file", animator->path);
-	xml.AddTransformAttribute(element, animator->transform);
+	xml->AddStringAttribute(element, "file", animator->path);
+	xml->AddTransformAttribute(element, animator->transform);
 }
 
-void WriteXML::WriteRig(XMLElement* element, const Rig* rig, const Entity* parent) {
+void WriteXML::WriteRig(XML_Element* element, const Rig* rig, const Entity* entity) {
 	element->SetName("rig");
 
+	const Entity* parent = entity->parent;
 	if (parent != nullptr && parent->type == Entity::Body) {
-		Body* body = static_cast<Body*>(parent->self);
-		Transform local_transform = TransformToLocalTransform(GetEntityTransform(parent->parent), body->transform);
-		local_transform = TransformToLocalTransform(local_transform, rig->transform);
-		xml.AddTransformAttribute(element, local_transform);
+		const Transform& body_world = context_mapping.Get(parent->handle)->world;
+		const Transform& rig_world = context_mapping.Get(entity->handle)->world;
+		xml->AddTransformAttribute(element, TransformToLocalTransform(body_world, rig_world));
 	} else
-		xml.AddTransformAttribute(element, rig->transform);
+		xml->AddTransformAttribute(element, rig->transform);
 
-	for (unsigned int i = 0; i < rig->locations.getSize(); i++) {
-		XMLElement* location = xml.AddChildElement(element, "location");
-		xml.AddStringAttribute(location, "tags", rig->locations[i].tags);
-		xml.AddTransformAttribute(location, rig->locations[i].transform);
+	for (Vec<RigLocation>::const_iterator it = rig->locations.begin(); it != rig->locations.end(); it++) {
+		XML_Element* location = xml->AddChildElement(element, "location");
+		xml->AddStringAttribute(location, "tags", it->tags);
+		xml->AddTransformAttribute(location, it->transform);
 	}
 }
 
-void WriteXML::WriteEntity(XMLElement* parent, const Entity* entity) {
-	XMLElement* element = xml.CreateDetachedElement("unknown");
-	xml.AddStringAttribute(element, "tags", ConcatTags(entity->tags));
-	xml.AddStringAttribute(element, "desc", entity->desc);
+void WriteXML::WriteEntity(XML_Element* parent, const Entity* entity) {
+	XML_Element* element = xml->CreateDetachedElement("unknown");
+	vector<XML_Element*> voxboxes; // Parts of a shape written next to it
+	xml->AddStringAttribute(element, "tags", ConcatTags(entity->tags));
+	xml->AddStringAttribute(element, "desc", entity->desc);
 
 	switch (entity->type) {
 		case Entity::Body: {
-			Body* body = static_cast<Body*>(entity->self);
+			Body* body = &scene.bodies[entity->index];
 			// Add world body as a group
 			if (entity->handle == scene.world_body) {
-				xml.AddTransformAttribute(xml.GetGroupElement(WORLD_BODY), body->transform);
-				if (parent == xml.GetScene())
-					parent = xml.GetGroupElement(WORLD_BODY);
+				xml->AddTransformAttribute(xml->GetGroupElement(WORLD_BODY), body->transform);
+				if (params.merge_shape_volume > 0)
+					MergeStaticShapes(entity);
+				if (parent == xml->GetScene())
+					parent = xml->GetGroupElement(WORLD_BODY);
 				element = nullptr;
 			} else {
 				// Skip empty bodies and wheel bodies
 				if ((entity->parent == nullptr || entity->parent->type != Entity::Wheel) && entity->children.getSize() > 0) {
+					if (params.merge_shape_volume > 0 && !body->dynamic)
+						MergeStaticShapes(entity);
 					WriteBody(element, body, entity->parent);
-					if (parent == xml.GetScene()) {
+					if (parent == xml->GetScene()) {
 						if (body->dynamic)
-							parent = xml.GetGroupElement(PROP);
+							parent = xml->GetGroupElement(PROP);
 						else
-							parent = xml.GetGroupElement(STATIC);
+							parent = xml->GetGroupElement(STATIC);
 					}
 				} else
 					element = nullptr;
@@ -907,16 +1462,24 @@ void WriteXML::WriteEntity(XMLElement* parent, const Entity* entity) {
 		}
 			break;
 		case Entity::Shape: {
-			Shape* shape = static_cast<Shape*>(entity->self);
+			Shape* shape = &scene.shapes[entity->index];
 			int volume = shape->voxels.sizex * shape->voxels.sizey * shape->voxels.sizez;
-			if (volume > 0)
-				WriteShape(element, shape, entity->handle);
-			else
+			EntityContext* context = context_mapping.Get(entity->handle);
+			if (volume > 0 && !context->merged) {
+				string name = "shape" + to_string(entity->handle);
+				if (shape->voxels.is_disconnected && !params.keep_disconnected_shapes &&
+					!context->referenced && entity->children.getSize() == 0 && entity->tags.getSize() == 0)
+					WriteShapeComponents(element, shape, entity->handle, name, voxboxes);
+				else
+					WriteShape(element, shape, entity->handle, name, voxboxes);
+				// Children are relative to the adjusted transform of .vox and compound shapes
+				context->transform = shape->transform;
+			} else
 				element = nullptr;
 		}
 			break;
 		case Entity::Light: {
-			Light* light = static_cast<Light*>(entity->self);
+			Light* light = &scene.lights[entity->index];
 			if (entity->parent != nullptr)
 				WriteLight(element, light, entity->parent);
 			else
@@ -924,57 +1487,48 @@ void WriteXML::WriteEntity(XMLElement* parent, const Entity* entity) {
 		}
 			break;
 		case Entity::Location: {
-			Location* location = static_cast<Location*>(entity->self);
-
-			Entity* vehicle_parent = entity->parent;
-			while (vehicle_parent != nullptr && vehicle_parent->type != Entity::Vehicle)
-				vehicle_parent = vehicle_parent->parent;
-			bool inside_vehicle = vehicle_parent != nullptr;
-
-			Entity* animator_parent = entity->parent;
-			while (animator_parent != nullptr && animator_parent->type != Entity::Animator)
-				animator_parent = animator_parent->parent;
-			bool inside_animator = animator_parent != nullptr;
+			Location* location = &scene.locations[entity->index];
 
+			const EntityContext* context = context_mapping.Get(entity->handle);
 			bool inside_rig = entity->parent != nullptr && entity->parent->type == Entity::Rig;
 
-			if (!inside_vehicle && !inside_animator && !inside_rig) {
+			if (!context->inside_vehicle && !context->inside_animator && !inside_rig) {
 				WriteLocation(element, location, entity->parent);
-				if (parent == xml.GetScene())
-					parent = xml.GetGroupElement(LOCATION);
+				if (parent == xml->GetScene())
+					parent = xml->GetGroupElement(LOCATION);
 			} else
 				element = nullptr;
 		}
 			break;
 		case Entity::Water: {
-			Water* water = static_cast<Water*>(entity->self);
+			Water* water = &scene.waters[entity->index];
 			WriteWater(element, water);
-			if (parent == xml.GetScene())
-				parent = xml.GetGroupElement(WATER);
+			if (parent == xml->GetScene())
+				parent = xml->GetGroupElement(WATER);
 		}
 			break;
 		case Entity::Joint: {
-			Joint* joint = static_cast<Joint*>(entity->self);
+			Joint* joint = &scene.joints[entity->index];
 			if (joint->type == Joint::_Rope) {
 				WriteRope(element, joint->rope, joint->size);
-				if (parent == xml.GetScene())
-					parent = xml.GetGroupElement(ROPE);
+				if (parent == xml->GetScene())
+					parent = xml->GetGroupElement(ROPE);
 			} else
 				element = nullptr;
 		}
 			break;
 		case Entity::Vehicle: {
 			bool is_boat = false;
-			for (unsigned int i = 0; i < entity->tags.getSize(); i++)
-				is_boat |= entity->tags[i].name == "boat";
-			Vehicle* vehicle = static_cast<Vehicle*>(entity->self);
+			for (SmallVec<Tag>::const_iterator it = entity->tags.begin(); it != entity->tags.end(); it++)
+				is_boat |= it->name == "boat";
+			Vehicle* vehicle = &scene.vehicles[entity->index];
 			WriteVehicle(element, vehicle, is_boat);
-			if (parent == xml.GetScene())
-				parent = xml.GetGroupElement(VEHICLE);
+			if (parent == xml->GetScene())
+				parent = xml->GetGroupElement(VEHICLE);
 		}
 			break;
 		case Entity::Wheel: {
-			Wheel* wheel = static_cast<Wheel*>(entity->self);
+			Wheel* wheel = &scene.wheels[entity->index];
 			WriteWheel(element, wheel, entity->parent);
 		}
 			break;
@@ -982,32 +1536,34 @@ void WriteXML::WriteEntity(XMLElement* parent, const Entity* entity) {
 			element = nullptr;
 			break;
 		case Entity::Screen: {
-			Screen* screen = static_cast<Screen*>(entity->self);
+			Screen* screen = &scene.screens[entity->index];
 			WriteScreen(element, screen, entity->parent);
 		}
 			break;
 		case Entity::Trigger: {
-			Trigger* trigger = static_cast<Trigger*>(entity->self);
+			Trigger* trigger = &scene.triggers[entity->index];
 			WriteTrigger(element, trigger);
-			if (parent == xml.GetScene())
-				parent = xml.GetGroupElement(TRIGGER);
+			if (parent == xml->GetScene())
+				parent = xml->GetGroupElement(TRIGGER);
 		}
 			break;
 		case Entity::Animator: {
-			Animator* animator = static_cast<Animator*>(entity->self);
+			Animator* animator = &scene.animators[entity->index];
 			WriteAnimator(element, animator);
 		}
 			break;
 		case Entity::Rig: {
-			Rig* rig = static_cast<Rig*>(entity->self);
-			WriteRig(element, rig, entity->parent);
+			Rig* rig = &scene.rigs[entity->index];
+			WriteRig(element, rig, entity);
 		}
 			break;
 	}
 
-	if (element != nullptr)
-		xml.AddEntityElement(parent, element, entity->handle);
-	else
+	if (element != nullptr) {
+		xml->AddEntityElement(parent, element, entity->handle);
+		for (unsigned int i = 0; i < voxboxes.size(); i++)
+			parent->InsertEndChild(voxboxes[i]);
+	} else
 		element = parent;
 
 	for (unsigned int i = 0; i < entity->children.getSize(); i++)
@@ -1016,23 +1572,21 @@ void WriteXML::WriteEntity(XMLElement* parent, const Entity* entity) {
 
 void WriteXML::WriteEntity2ndPass(const Entity* entity) {
 	if (entity->type == Entity::Vehicle) {
-		Vehicle* vehicle = static_cast<Vehicle*>(entity->self);
-		int vital_count = vehicle->vitals.getSize();
-		for (int i = 0; i < vital_count; i++) {
-			uint32_t body_handle = vehicle->vitals[i].body;
-			XMLElement* body_xml = xml.GetEntityElement(body_handle);
+		Vehicle* vehicle = &scene.vehicles[entity->index];
+		for (Vec<Vital>::const_iterator it = vehicle->vitals.begin(); it != vehicle->vitals.end(); it++) {
+			XML_Element* body_xml = xml->GetEntityElement(it->body);
 			if (body_xml != nullptr) {
-				XMLElement* vital = xml.AddChildElement(body_xml, "location");
-				xml.AddStringAttribute(vital, "tags", "vital");
-				xml.AddVec3Attribute(vital, "pos", vehicle->vitals[i].position, "0 0 0");
+				XML_Element* vital = xml->AddChildElement(body_xml, "location");
+				xml->AddStringAttribute(vital, "tags", "vital");
+				xml->AddVec3Attribute(vital, "pos", it->position, Vec3(0, 0, 0));
 			}
 		}
 	} else if (entity->type == Entity::Joint) {
-		Joint* joint = static_cast<Joint*>(entity->self);
+		Joint* joint = &scene.joints[entity->index];
 		if (joint->type != Joint::_Rope)
 			WriteJoint(joint, ConcatTags(entity->tags));
 	} else if (entity->type == Entity::Script) {
-		Script* script = static_cast<Script*>(entity->self);
+		Script* script = &scene.scripts[entity->index];
 		WriteScript(script);
 	}
 
@@ -2,46 +2,108 @@
 #define WRITE_SCENE_H
 
 #include <stdint.h>
+#include <atomic>
+#include <bitset>
 #include <map>
 #include <string>
 #include <vector>
 
 #include "parser.h"
+#include "shape_encoding.h"
+#include "vox_writer.h"
 #include "xml_writer.h"
 
-class MV_FILE;
-namespace tinyxml2 { class XMLElement; }
 
 using namespace std;
 
+// Entity state computed in a single pass before writing
+struct EntityContext {
+	Transform transform;	// As stored in the scene, world or parent relative
+	Transform world;		// Stored transform in world space
+	bool inside_vehicle;	// Some ancestor is a vehicle
+	bool inside_animator;	// Some ancestor is an animator
+	bool referenced;		// Used by a joint or script, its shape cannot be merged or split
+	bool merged;			// Voxels moved into a sibling shape, nothing to write
+};
+
+// Model of a shape and the palette entries it uses. Shapes written on worker
+// threads are added to the .vox files later, in the original order.
+struct PendingVox {
+	string group;
+	MV_Shape mvshape;
+	uint64_t hash;
+	bool add_hole;		// Reserve the hole palette entry
+	bitset<256> used;	// Palette entries used by the voxels
+	int palette_id;
+	XML_Element* element; // Gets the file and object attributes, null for empty parts
+};
+
+// Top-level entity written by a worker thread
+struct EntityTask {
+	const Entity* entity;
+	XML_Writer* writer;
+	XML_Writer::Mark start;
+	XML_Writer::Mark end;
+	vector<PendingVox> vox;
+};
+
 class WriteXML : public TDBIN {
 private:
-	XML_Writer xml;
+	XML_Writer main_xml;
+	static thread_local XML_Writer* xml; // Writer of the current thread
+	static thread_local vector<PendingVox>* pending_vox; // Null on the main thread
 	ConverterParams params;
-	map<uint32_t, MV_FILE*> vox_files;
+	map<string, vector<MV_FILE*>> vox_files; // Shards of each palette file
+	MV_Manifest vox_manifest; // Files written by the previous conversion
+
+	string GetManifestPath();
+
+	vector<EntityContext> contexts; // In traversal order
+	HandleMap<EntityContext> context_mapping;
+	void BuildContexts(const Entity* entity, const EntityContext* parent, const Transform& frame);
+	void MarkReferencedShapes();
+	Transform GetEntityTransform(const Entity* entity);
+	Transform GetParentTransform(const Entity* parent);
+	Transform GetLocalTransform(const Entity* parent, const Transform& tr);
+
+	string GetVoxGroup(const Shape* shape, int handle);
+	string GetVoxShardName(const string& group, int shard);
+	MV_FILE* CreateVoxFile(const string& name);
+	MV_FILE* GetVoxFile(const string& group);
+	string AddVoxShape(const string& group, const MV_Shape& mvshape, uint64_t hash, string& vox_object);
+	void AddPendingVox(PendingVox& vox);
+	void WritePendingVox(PendingVox& vox);
+
+	vector<EntityTask> entity_tasks;
+	atomic<unsigned int> next_task;
+	static void* EntityWorker(void* data);
+	void WriteEntitiesParallel(unsigned int thread_count);
 
-	void WriteBody(XMLElement* element, const Body* body, const Entity* parent);
-	void WriteShape(XMLElement* element, Shape* shape, int handle);
-	void WriteLight(XMLElement* element, const Light* light, const Entity* parent);
-	void WriteLocation(XMLElement* element, const Location* location, const Entity* parent);
-	void WriteWater(XMLElement* element, const Water* water);
+	void WriteBody(XML_Element* element, const Body* body, const Entity* parent);
+	void MergeStaticShapes(const Entity* body);
+	void WriteShape(XML_Element* element, Shape* shape, int handle, const string& name, vector<XML_Element*>& voxboxes);
+	void WriteShapeComponents(XML_Element* element, Shape* shape, int handle, const string& name, vector<XML_Element*>& voxboxes);
+	void WriteLight(XML_Element* element, const Light* light, const Entity* parent);
+	void WriteLocation(XML_Element* element, const Location* location, const Entity* parent);
+	void WriteWater(XML_Element* element, const Water* water);
 	void WriteJoint(const Joint* joint, string tags);
-	void WriteVehicle(XMLElement* element, const Vehicle* vehicle, bool is_boat);
-	void WriteWheel(XMLElement* element, const Wheel* wheel, const Entity* parent);
-	void WriteScreen(XMLElement* element, const Screen* screen, const Entity* parent);
-	void WriteTrigger(XMLElement* element, const Trigger* trigger);
+	void WriteVehicle(XML_Element* element, const Vehicle* vehicle, bool is_boat);
+	void WriteWheel(XML_Element* element, const Wheel* wheel, const Entity* parent);
+	void WriteScreen(XML_Element* element, const Screen* screen, const Entity* parent);
+	void WriteTrigger(XML_Element* element, const Trigger* trigger);
 	void WriteScript(const Script* script);
-	void WriteAnimator(XMLElement* element, const Animator* animator);
-	void WriteRig(XMLElement* element, const Rig* rig, const Entity* parent);
+	void WriteAnimator(XML_Element* element, const Animator* animator);
+	void WriteRig(XML_Element* element, const Rig* rig, const Entity* entity);
 
 	void WriteEntity2ndPass(const Entity* entity);
-	void WriteEntity(XMLElement* parent, const Entity* entity);
+	void WriteEntity(XML_Element* parent, const Entity* entity);
 
-	void WriteRope(XMLElement* element, const Rope* rope, float size);
-	void WriteVox(XMLElement* element, Shape* shape, int handle);
-	void WriteVoxbox(XMLElement* element, const Shape* shape);
-	void WriteCompound(XMLElement* element, Shape* shape, int handle);
-	void WriteCompoundShape(XMLElement* parent, const Shape* shape, int handle, int i, int j, int k);
+	void WriteRope(XML_Element* element, const Rope* rope, float size);
+	void WriteVox(XML_Element* element, Shape* shape, int handle, const string& name);
+	void WriteVoxbox(XML_Element* element, const Shape* shape, const VoxelBox& box);
+	void WriteVoxboxes(XML_Element* element, Shape* shape, int handle, const string& name, const ShapeEncoding& encoding, vector<XML_Element*>& voxboxes);
+	void WriteCompound(XML_Element* element, Shape* shape, int handle, const string& name);
+	void WriteCompoundShape(XML_Element* parent, const Shape* shape, int handle, const string& name, int part_index, const VoxelBox& part);
 public:
 	WriteXML(ConverterParams params);
 	~WriteXML();
@@ -53,6 +115,7 @@ public:
 	void WritePostProcessing();
 
 	void WriteEntities();
+	void WritePrefabs();
 	void SaveXML();
 	void SaveVoxFiles();
 };
@@ -1,10 +1,9 @@
-#include <iomanip>
 #include <math.h>
-#include <sstream>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <string>
 
-#include "../lib/tinyxml2.h"
 #include "entity.h"
 #include "misc_utils.h"
 #include "xml_writer.h"
@@ -13,156 +12,413 @@ static const char* GroupName[] = {"World Body", "Static bodies", "Props",	 "Loca
 								  "Ropes",		"Vehicles",		 "Triggers", "Scripts"};
 
 string XML_Writer::FloatToString(float value) {
+	return ::FloatToString(value, precision);
+}
+
+// Whether FloatToString gives the same text for both values, without formatting them
+bool XML_Writer::IsDefault(float value, float default_value) {
+	static const double HALF_STEP[] = { 0.5, 0.05, 5e-3, 5e-4, 5e-5, 5e-6, 5e-7, 5e-8, 5e-9, 5e-10, 5e-11 };
+	if (precision < 0 || precision > 10 || isnan(value) || isnan(default_value))
+		return FloatToString(value) == FloatToString(default_value);
 	if (fabs(value) < 0.0005)
 		value = 0;
-	ostringstream ss;
-	ss << fixed << setprecision(precision) << value;
-	string str = ss.str();
-	if (str.find('.') != string::npos) {
-		str.erase(str.find_last_not_of('0') + 1);
-		if (str.back() == '.')
-			str.pop_back();
+	if (fabs(default_value) < 0.0005)
+		default_value = 0;
+	// A negative value rounded to zero keeps its sign
+	if ((value < 0) != (default_value < 0))
+		return false;
+
+	double half_step = HALF_STEP[precision];
+	double scale = 0.5 / half_step;
+	double rounded_default = round(default_value * scale) / scale;
+	double tolerance = half_step * 1e-6 + fabs(rounded_default) * 1e-12;
+	if (fabs(default_value - rounded_default) < half_step - tolerance) {
+		double diff = fabs(value - rounded_default);
+		if (diff < half_step - tolerance)
+			return true;
+		if (diff > half_step + tolerance)
+			return false;
 	}
-	return str;
+	// Close to a rounding boundary
+	return FloatToString(value) == FloatToString(default_value);
+}
+
+const char* XML_Element::Name() const {
+	return name;
+}
+
+void XML_Element::SetName(const char* name) {
+	this->name = name;
+}
+
+XML_Element* XML_Element::Parent() const {
+	return parent;
+}
+
+XML_Element* XML_Element::FirstChild() const {
+	return first_child;
+}
+
+XML_Element* XML_Element::NextSibling() const {
+	return next_sibling;
+}
+
+bool XML_Element::NoChildren() const {
+	return first_child == nullptr;
+}
+
+void XML_Element::InsertEndChild(XML_Element* child) {
+	child->Unlink();
+	child->parent = this;
+	child->prev_sibling = last_child;
+	if (last_child != nullptr)
+		last_child->next_sibling = child;
+	else
+		first_child = child;
+	last_child = child;
+	child_count++;
+}
+
+void XML_Element::Unlink() {
+	if (parent == nullptr)
+		return;
+	if (prev_sibling != nullptr)
+		prev_sibling->next_sibling = next_sibling;
+	else
+		parent->first_child = next_sibling;
+	if (next_sibling != nullptr)
+		next_sibling->prev_sibling = prev_sibling;
+	else
+		parent->last_child = prev_sibling;
+	parent->child_count--;
+	parent = nullptr;
+	prev_sibling = nullptr;
+	next_sibling = nullptr;
 }
 
 XML_Writer::XML_Writer() {
-	scene = main_xml.NewElement("scene");
-	main_xml.InsertEndChild(scene);
+	scene = arena.New<XML_Element>("scene");
 }
 
 void XML_Writer::CreateGroups() {
 	for (unsigned int i = 0; i < GROUP_COUNT; i++) {
-		groups[i] = main_xml.NewElement("group");
-		groups[i]->SetAttribute("name", GroupName[i]);
-		scene->InsertEndChild(groups[i]);
+		groups[i] = AddChildElement(scene, "group");
+		SetAttribute(groups[i], "name", GroupName[i]);
+	}
+}
+
+XML_Writer::Mark XML_Writer::GetMark() const {
+	Mark mark;
+	for (unsigned int i = 0; i < GROUP_COUNT; i++)
+		mark[i] = groups[i]->child_count;
+	mark[GROUP_COUNT] = scene->child_count;
+	return mark;
+}
+
+// Moves the children added to the source between both marks. Earlier
+// children must have been moved already, so these are the first ones.
+void XML_Writer::MoveChildren(XML_Writer& source, const Mark& start, const Mark& end) {
+	for (unsigned int i = 0; i < GROUP_COUNT; i++)
+		for (unsigned int j = start[i]; j < end[i]; j++)
+			groups[i]->InsertEndChild(source.groups[i]->first_child);
+	for (unsigned int j = start[GROUP_COUNT]; j < end[GROUP_COUNT]; j++)
+		scene->InsertEndChild(source.groups[GROUP_COUNT - 1]->next_sibling);
+}
+
+// Takes the memory, the entity elements and the group attributes of the source
+void XML_Writer::Merge(XML_Writer& source) {
+	arena.Adopt(source.arena);
+	source.element_mapping.ForEach([this](uint32_t handle, XML_Element* element) {
+		element_mapping.Set(handle, element);
+	});
+	for (unsigned int i = 0; i < GROUP_COUNT; i++) {
+		const XML_Attribute* attribute = source.groups[i]->first_attribute->next; // After the name
+		for (; attribute != nullptr; attribute = attribute->next)
+			SetAttribute(groups[i], attribute->name, attribute->value);
+	}
+}
+
+// Same layout as the tinyxml2 printer: tab indentation and escaped attribute values
+void XML_Writer::WriteElement(const XML_Element* element, int depth, string& buffer, FILE* file) {
+	if (depth > 0)
+		buffer += '\n';
+	buffer.append(depth, '\t');
+	buffer += '<';
+	buffer += element->name;
+	for (const XML_Attribute* attribute = element->first_attribute; attribute != nullptr; attribute = attribute->next) {
+		if (attribute->value == nullptr)
+			continue;
+		buffer += ' ';
+		buffer += attribute->name;
+		buffer += "=\"";
+		for (const char* c = attribute->value; *c != '\0'; c++) {
+			switch (*c) {
+			case '"': buffer += "&quot;"; break;
+			case '&': buffer += "&amp;"; break;
+			case '\'': buffer += "&apos;"; break;
+			case '<': buffer += "&lt;"; break;
+			case '>': buffer += "&gt;"; break;
+			default: buffer += *c;
+			}
+		}
+		buffer += '"';
+	}
+
+	if (element->first_child == nullptr)
+		buffer += "/>";
+	else {
+		buffer += '>';
+		for (const XML_Element* child = element->first_child; child != nullptr; child = child->next_sibling)
+			WriteElement(child, depth + 1, buffer, file);
+		buffer += '\n';
+		buffer.append(depth, '\t');
+		buffer += "</";
+		buffer += element->name;
+		buffer += '>';
+	}
+	if (depth == 0)
+		buffer += '\n';
+
+	if (file != nullptr && buffer.size() >= BUFFER_SIZE) {
+		fwrite(buffer.data(), sizeof(char), buffer.size(), file);
+		buffer.clear();
 	}
 }
 
 void XML_Writer::SaveFile(const char* filename) {
 	for (unsigned int i = 0; i < GROUP_COUNT; i++)
 		if (groups[i]->NoChildren())
-			scene->DeleteChild(groups[i]);
-	main_xml.SaveFile(filename);
+			groups[i]->Unlink();
+
+	WriteFile(scene, filename);
+}
+
+void XML_Writer::WriteFile(const XML_Element* root, const char* filename) {
+	FILE* file = fopen(filename, "wb");
+	if (file == nullptr) {
+		printf("[ERROR] Could not open %s for writing\n", filename);
+		return;
+	}
+	string buffer;
+	buffer.reserve(2 * BUFFER_SIZE);
+	WriteElement(root, 0, buffer, file);
+	fwrite(buffer.data(), sizeof(char), buffer.size(), file);
+	fclose(file);
+}
+
+// Text of the element and its children, without the transform of the element
+string XML_Writer::GetSubtreeKey(XML_Element* element) {
+	XML_Attribute* transform[2] = { nullptr, nullptr };
+	const char* transform_values[2] = { nullptr, nullptr };
+	for (XML_Attribute* attribute = element->first_attribute; attribute != nullptr; attribute = attribute->next) {
+		int i = strcmp(attribute->name, "pos") == 0 ? 0 : strcmp(attribute->name, "rot") == 0 ? 1 : -1;
+		if (i >= 0) {
+			transform[i] = attribute;
+			transform_values[i] = attribute->value;
+			attribute->value = nullptr;
+		}
+	}
+	string key;
+	WriteElement(element, 0, key, nullptr);
+	for (int i = 0; i < 2; i++)
+		if (transform[i] != nullptr)
+			transform[i]->value = transform_values[i];
+	return key;
+}
+
+// Puts an instance of the file in place of the element, with the same transform
+XML_Element* XML_Writer::ReplaceWithInstance(XML_Element* element, const string& file) {
+	XML_Element* instance = arena.New<XML_Element>("instance");
+	SetAttribute(instance, "file", file.c_str());
+	for (const XML_Attribute* attribute = element->first_attribute; attribute != nullptr; attribute = attribute->next)
+		if (attribute->value != nullptr && (strcmp(attribute->name, "pos") == 0 || strcmp(attribute->name, "rot") == 0))
+			SetAttribute(instance, attribute->name, attribute->value);
+
+	instance->parent = element->parent;
+	instance->prev_sibling = element->prev_sibling;
+	instance->next_sibling = element->next_sibling;
+	if (element->prev_sibling != nullptr)
+		element->prev_sibling->next_sibling = instance;
+	else
+		element->parent->first_child = instance;
+	if (element->next_sibling != nullptr)
+		element->next_sibling->prev_sibling = instance;
+	else
+		element->parent->last_child = instance;
+	element->parent = nullptr;
+	element->prev_sibling = nullptr;
+	element->next_sibling = nullptr;
+	return instance;
+}
+
+// The transform of the element is left to the instances
+void XML_Writer::SavePrefab(XML_Element* element, const string& version, const char* filename) {
+	for (XML_Attribute* attribute = element->first_attribute; attribute != nullptr; attribute = attribute->next)
+		if (strcmp(attribute->name, "pos") == 0 || strcmp(attribute->name, "rot") == 0)
+			attribute->value = nullptr;
+	XML_Element* prefab = arena.New<XML_Element>("prefab");
+	SetAttribute(prefab, "version", version.c_str());
+	prefab->InsertEndChild(element);
+	WriteFile(prefab, filename);
 }
 
 void XML_Writer::SetTransformPrecision(int precision) {
 	transform_precision = precision;
 }
 
-XMLElement* XML_Writer::GetScene() {
+XML_Element* XML_Writer::GetScene() {
 	return scene;
 }
 
-XMLElement* XML_Writer::GetGroupElement(GroupType type) {
+XML_Element* XML_Writer::GetGroupElement(GroupType type) {
 	return groups[type];
 }
 
-XMLElement* XML_Writer::GetEntityElement(int handle) {
-	if (element_mapping.find(handle) != element_mapping.end())
-		return element_mapping[handle];
-	return nullptr;
+XML_Element* XML_Writer::GetEntityElement(int handle) {
+	return element_mapping.Get(handle);
 }
 
-XMLElement* XML_Writer::AddChildElement(XMLElement* parent, const char* name) {
-	XMLElement* element = main_xml.NewElement(name);
+XML_Element* XML_Writer::AddChildElement(XML_Element* parent, const char* name) {
+	XML_Element* element = arena.New<XML_Element>(name);
 	parent->InsertEndChild(element);
 	return element;
 }
 
-XMLElement* XML_Writer::CreateDetachedElement(const char* name) {
-	return main_xml.NewElement(name);
+XML_Element* XML_Writer::CreateDetachedElement(const char* name) {
+	return arena.New<XML_Element>(name);
+}
+
+// Attribute names are stored once, values are copied into the arena
+void XML_Writer::SetAttribute(XML_Element* element, const char* name, const char* value) {
+	const char*& stored_name = attribute_names[name];
+	if (stored_name == nullptr)
+		stored_name = arena.CopyString(name, strlen(name));
+	const char* stored_value = arena.CopyString(value, strlen(value));
+
+	for (XML_Attribute* attribute = element->first_attribute; attribute != nullptr; attribute = attribute->next)
+		if (strcmp(attribute->name, stored_name) == 0) { // Names may come from another writer
+			attribute->value = stored_value;
+			return;
+		}
+	XML_Attribute* attribute = arena.New<XML_Attribute>();
+	attribute->name = stored_name;
+	attribute->value = stored_value;
+	attribute->next = nullptr;
+	if (element->last_attribute != nullptr)
+		element->last_attribute->next = attribute;
+	else
+		element->first_attribute = attribute;
+	element->last_attribute = attribute;
+}
+
+void XML_Writer::SetAttribute(XML_Element* element, const char* name, int value) {
+	SetAttribute(element, name, to_string(value).c_str());
 }
 
-void XML_Writer::AddEntityElement(XMLElement* parent, XMLElement* child, int handle) {
+void XML_Writer::SetAttribute(XML_Element* element, const char* name, bool value) {
+	SetAttribute(element, name, value ? "true" : "false");
+}
+
+void XML_Writer::AddEntityElement(XML_Element* parent, XML_Element* child, int handle) {
 	parent->InsertEndChild(child);
-	element_mapping[handle] = child;
+	element_mapping.Set(handle, child);
 }
 
-void XML_Writer::AddExhaustTagAttribute(XMLElement* element, float strength) {
+void XML_Writer::AddExhaustTagAttribute(XML_Element* element, float strength) {
 	string buffer = "exhaust";
 	if (strength != 1.0)
 		buffer += "=" + FloatToString(strength);
-	element->SetAttribute("tags", buffer.c_str());
+	SetAttribute(element, "tags", buffer.c_str());
 }
 
-void XML_Writer::AddTransformAttribute(XMLElement* element, const Transform& tr) {
+void XML_Writer::AddTransformAttribute(XML_Element* element, const Transform& tr) {
 	precision = transform_precision;
-	AddVec3Attribute(element, "pos", tr.pos, "0 0 0");
-	AddVec3Attribute(element, "rot", QuatToEuler(tr.rot), "0 0 0");
+	AddVec3Attribute(element, "pos", tr.pos, Vec3(0, 0, 0));
+	AddVec3Attribute(element, "rot", QuatToEuler(tr.rot), Vec3(0, 0, 0));
 	precision = DEFAULT_PRECISION;
 }
 
-void XML_Writer::AddVerticesAttribute(XMLElement* element, const Vec<Vec2>& vertices) {
+void XML_Writer::AddVerticesAttribute(XML_Element* element, const Vec<Vec2>& vertices) {
 	for (unsigned int i = 0; i < vertices.getSize(); i++) {
-		XMLElement* vertex = main_xml.NewElement("vertex");
-		element->InsertEndChild(vertex);
-		AddVec2Attribute(vertex, "pos", vertices[i], "0 0");
+		XML_Element* vertex = AddChildElement(element, "vertex");
+		AddVec2Attribute(vertex, "pos", vertices[i], Vec2(0, 0));
 	}
 }
 
-void XML_Writer::AddTextureAttribute(XMLElement* element, const char* name, Texture value) {
+void XML_Writer::AddTextureAttribute(XML_Element* element, const char* name, Texture value) {
 	string buffer = to_string(value.tile);
 	if (value.weight != 1.0)
 		buffer += " " + FloatToString(value.weight);
 	if (value.tile != 0)
-		element->SetAttribute(name, buffer.c_str());
+		SetAttribute(element, name, buffer.c_str());
 }
 
-void XML_Writer::AddIntAttribute(XMLElement* element, const char* name, int value, int default_value) {
+void XML_Writer::AddIntAttribute(XML_Element* element, const char* name, int value, int default_value) {
 	if (value != default_value)
-		element->SetAttribute(name, value);
+		SetAttribute(element, name, value);
 }
 
-void XML_Writer::AddBoolAttribute(XMLElement* element, const char* name, bool value, bool default_value) {
+void XML_Writer::AddBoolAttribute(XML_Element* element, const char* name, bool value, bool default_value) {
 	if (value != default_value)
-		element->SetAttribute(name, value);
+		SetAttribute(element, name, value);
 }
 
-void XML_Writer::AddVec2Attribute(XMLElement* element, const char* name, Vec2 value, string default_value) {
+void XML_Writer::AddVec2Attribute(XML_Element* element, const char* name, Vec2 value, Vec2 default_value) {
+	if (IsDefault(value.x, default_value.x) && IsDefault(value.y, default_value.y))
+		return;
 	string buffer = FloatToString(value.x) + " " + FloatToString(value.y);
-	if (buffer != default_value)
-		element->SetAttribute(name, buffer.c_str());
+	SetAttribute(element, name, buffer.c_str());
 }
 
-void XML_Writer::AddVec3Attribute(XMLElement* element, const char* name, Vec3 value, string default_value) {
+void XML_Writer::AddVec3Attribute(XML_Element* element, const char* name, Vec3 value) {
 	string buffer = FloatToString(value.x) + " " + FloatToString(value.y) + " " + FloatToString(value.z);
-	if (buffer != default_value)
-		element->SetAttribute(name, buffer.c_str());
+	SetAttribute(element, name, buffer.c_str());
+}
+
+void XML_Writer::AddVec3Attribute(XML_Element* element, const char* name, Vec3 value, Vec3 default_value) {
+	if (IsDefault(value.x, default_value.x) && IsDefault(value.y, default_value.y) && IsDefault(value.z, default_value.z))
+		return;
+	AddVec3Attribute(element, name, value);
 }
 
-void XML_Writer::AddVec4Attribute(XMLElement* element, const char* name, Vec4 value, string default_value) {
+void XML_Writer::AddVec4Attribute(XML_Element* element, const char* name, Vec4 value, Vec4 default_value) {
+	if (IsDefault(value.x, default_value.x) && IsDefault(value.y, default_value.y) &&
+		IsDefault(value.z, default_value.z) && IsDefault(value.w, default_value.w))
+		return;
 	string buffer = FloatToString(value.x) + " " + FloatToString(value.y) + " " + FloatToString(value.z) + " " +
 					FloatToString(value.w);
-	if (buffer != default_value)
-		element->SetAttribute(name, buffer.c_str());
+	SetAttribute(element, name, buffer.c_str());
 }
 
-void XML_Writer::AddColorAttribute(XMLElement* element, const char* name, Color value, string default_value) {
+void XML_Writer::AddColorAttribute(XML_Element* element, const char* name, Color value, Color default_value) {
+	// Alpha is only written when it is neither 0 nor 1
+	bool has_alpha = value.a != 0.0 && value.a != 1.0;
+	bool default_has_alpha = default_value.a != 0.0 && default_value.a != 1.0;
+	if (IsDefault(value.r, default_value.r) && IsDefault(value.g, default_value.g) && IsDefault(value.b, default_value.b) &&
+		has_alpha == default_has_alpha && (!has_alpha || IsDefault(value.a, default_value.a)))
+		return;
 	string buffer = FloatToString(value.r) + " " + FloatToString(value.g) + " " + FloatToString(value.b);
-	if (value.a != 0.0 && value.a != 1.0)
+	if (has_alpha)
 		buffer += " " + FloatToString(value.a);
-	if (buffer != default_value)
-		element->SetAttribute(name, buffer.c_str());
+	SetAttribute(element, name, buffer.c_str());
 }
 
-void XML_Writer::AddSoundAttribute(XMLElement* element, const char* name, Sound value, string default_value) {
+void XML_Writer::AddSoundAttribute(XML_Element* element, const char* name, Sound value, string default_value) {
 	string buffer = value.path;
 	if (value.volume != 1.0)
 		buffer += " " + FloatToString(value.volume);
 	if (buffer != "" && buffer != default_value)
-		element->SetAttribute(name, buffer.c_str());
+		SetAttribute(element, name, buffer.c_str());
 	else if (default_value != "")
-		element->SetAttribute(name, default_value.c_str());
+		SetAttribute(element, name, default_value.c_str());
 }
 
-void XML_Writer::AddFloatAttribute(XMLElement* element, const char* name, float value, string default_value) {
-	string buffer = FloatToString(value);
-	if (buffer != default_value)
-		element->SetAttribute(name, buffer.c_str());
+void XML_Writer::AddFloatAttribute(XML_Element* element, const char* name, float value, float default_value) {
+	if (!IsDefault(value, default_value))
+		SetAttribute(element, name, FloatToString(value).c_str());
 }
 
-void XML_Writer::AddStringAttribute(XMLElement* element, const char* name, string value, string default_value) {
+void XML_Writer::AddStringAttribute(XML_Element* element, const char* name, string value, string default_value) {
 	if (value != default_value)
-		element->SetAttribute(name, value.c_str());
+		SetAttribute(element, name, value.c_str());
 }
@@ -1,55 +1,112 @@
 #ifndef XML_WRITER_H
 #define XML_WRITER_H
 
-#include "../lib/tinyxml2.h"
+#include <stdio.h>
 #include <array>
-#include <map>
 #include <stdint.h>
 #include <string>
+#include <unordered_map>
+
+#include "arena.h"
+#include "handle_map.h"
 
 using namespace std;
-using namespace tinyxml2;
 
 enum GroupType { WORLD_BODY, STATIC, PROP, LOCATION, WATER, ROPE, VEHICLE, TRIGGER, SCRIPT };
 
+struct XML_Attribute {
+	const char* name;
+	const char* value; // Null if the attribute was removed
+	XML_Attribute* next;
+};
+
+// Node of the main.xml tree, allocated in the arena of the XML_Writer.
+// Element names are not copied, they must be string literals.
+class XML_Element {
+private:
+	const char* name;
+	XML_Element* parent = nullptr;
+	XML_Element* first_child = nullptr;
+	XML_Element* last_child = nullptr;
+	XML_Element* prev_sibling = nullptr;
+	XML_Element* next_sibling = nullptr;
+	XML_Attribute* first_attribute = nullptr;
+	XML_Attribute* last_attribute = nullptr;
+	unsigned int child_count = 0;
+	friend class XML_Writer;
+public:
+	XML_Element(const char* name) : name(name) {}
+	const char* Name() const;
+	void SetName(const char* name);
+	XML_Element* Parent() const;
+	XML_Element* FirstChild() const;
+	XML_Element* NextSibling() const;
+	bool NoChildren() const;
+	void InsertEndChild(XML_Element* child); // Moves the child if it already has a parent
+	void Unlink();
+};
+
 class XML_Writer {
 private:
-	XMLDocument main_xml;
-	XMLElement* scene;
+	Arena arena;
+	unordered_map<string, const char*> attribute_names;
+	XML_Element* scene;
 	static const unsigned int GROUP_COUNT = 9;
-	array<XMLElement*, GROUP_COUNT> groups;
-	map<int, XMLElement*> element_mapping;
+	array<XML_Element*, GROUP_COUNT> groups;
+	HandleMap<XML_Element> element_mapping;
+	static const size_t BUFFER_SIZE = 1 << 16;
 	const unsigned int DEFAULT_PRECISION = 3;
 	int precision = DEFAULT_PRECISION;
 	int transform_precision = DEFAULT_PRECISION;
 	string FloatToString(float value);
+	bool IsDefault(float value, float default_value);
+
+	void SetAttribute(XML_Element* element, const char* name, const char* value);
+	void SetAttribute(XML_Element* element, const char* name, int value);
+	void SetAttribute(XML_Element* element, const char* name, bool value);
+	void WriteElement(const XML_Element* element, int depth, string& buffer, FILE* file);
+	void WriteFile(const XML_Element* root, const char* filename);
 public:
 	XML_Writer();
 	void CreateGroups();
+
+	// Number of children of each group and of the scene. Used to move what
+	// a worker wrote for each entity into this writer in the original order.
+	typedef array<unsigned int, GROUP_COUNT + 1> Mark;
+	Mark GetMark() const;
+	void MoveChildren(XML_Writer& source, const Mark& start, const Mark& end);
+	void Merge(XML_Writer& source);
+
 	void SaveFile(const char* filename);
+
+	// Repeated subtrees are saved once as a prefab and referenced by instances
+	string GetSubtreeKey(XML_Element* element);
+	XML_Element* ReplaceWithInstance(XML_Element* element, const string& file);
+	void SavePrefab(XML_Element* element, const string& version, const char* filename);
 	void SetTransformPrecision(int precision);
 
-	XMLElement* GetScene();
-	XMLElement* GetGroupElement(GroupType type);
-	XMLElement* GetEntityElement(int handle);
-
-	XMLElement* AddChildElement(XMLElement* parent, const char* name);
-	XMLElement* CreateDetachedElement(const char* name);
-	void AddEntityElement(XMLElement* parent, XMLElement* child, int handle);
-
-	void AddExhaustTagAttribute(XMLElement* element, float strength);
-	void AddTransformAttribute(XMLElement* element, const Transform& tr);
-	void AddVerticesAttribute(XMLElement* element, const Vec<Vec2>& vertices);
-	void AddTextureAttribute(XMLElement* element, const char* name, Texture value);
-	void AddIntAttribute(XMLElement* element, const char* name, int value, int default_value);
-	void AddBoolAttribute(XMLElement* element, const char* name, bool value, bool default_value);
-	void AddVec2Attribute(XMLElement* element, const char* name, Vec2 value, string default_value);
-	void AddVec3Attribute(XMLElement* element, const char* name, Vec3 value, string default_value);
-	void AddVec4Attribute(XMLElement* element, const char* name, Vec4 value, string default_value);
-	void AddColorAttribute(XMLElement* element, const char* name, Color value, string default_value);
-	void AddSoundAttribute(XMLElement* element, const char* name, Sound value, string default_value);
-	void AddFloatAttribute(XMLElement* element, const char* name, float value, string default_value);
-	void AddStringAttribute(XMLElement* element, const char* name, string value, string default_value = "");
+	XML_Element* GetScene();
+	XML_Element* GetGroupElement(GroupType type);
+	XML_Element* GetEntityElement(int handle);
+
+	XML_Element* AddChildElement(XML_Element* parent, const char* name);
+	XML_Element* CreateDetachedElement(const char* name);
+	void AddEntityElement(XML_Element* parent, XML_Element* child, int handle);
+
+	void AddExhaustTagAttribute(XML_Element* element, float strength);
+	void AddTransformAttribute(XML_Element* element, const Transform& tr);
+	void AddVerticesAttribute(XML_Element* element, const Vec<Vec2>& vertices);
+	void AddTextureAttribute(XML_Element* element, const char* name, Texture value);
+	void AddIntAttribute(XML_Element* element, const char* name, int value, int default_value);
+	void AddBoolAttribute(XML_Element* element, const char* name, bool value, bool default_value);
+	void AddVec2Attribute(XML_Element* element, const char* name, Vec2 value, Vec2 default_value);
+	void AddVec3Attribute(XML_Element* element, const char* name, Vec3 value);
+	void AddVec3Attribute(XML_Element* element, const char* name, Vec3 value, Vec3 default_value);
+	void AddVec4Attribute(XML_Element* element, const char* name, Vec4 value, Vec4 default_value);
+	void AddColorAttribute(XML_Element* element, const char* name, Color value, Color default_value);
+	void AddSoundAttribute(XML_Element* element, const char* name, Sound value, string default_value);
+	void AddFloatAttribute(XML_Element* element, const char* name, float value, float default_value);
+	void AddStringAttribute(XML_Element* element, const char* name, string value, string default_value = "");
 };
 
 #endif